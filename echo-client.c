@@ -23,6 +23,8 @@
 #include <stdlib.h>
 #include <string.h>
 #include <stdbool.h>
+#include <stdint.h>
+#include <stddef.h>
 #include <net/if.h>
 #include <linux/sockios.h>
 #include <ifaddrs.h>
@@ -32,9 +34,17 @@
 #include <sys/time.h>
 #include <signal.h>
 
+#include "results.h"
+
 #define SERVER_PORT  4242
 #define CLIENT_PORT  0
 #define MAX_TIMEOUT  5		/* in seconds */
+#define MAX_BUF_SIZE 65536	/* largest generated payload */
+#define MAX_UDP_PAYLOAD 65507
+#define MAX_STREAM_SIZE (64 * 1024 * 1024)	/* largest TCP payload */
+#define TCP_CHUNK_SIZE 16384
+
+#define DEFAULT_PAYLOAD_COUNT 100
 
 #define MIN(a,b) (((a) < (b)) ? (a) : (b))
 
@@ -55,8 +65,6 @@ static const unsigned char lorem_ipsum[] = \
 	"\n"
 	"Ut eget neque quis nisi volutpat consectetur. Curabitur faucibus metus non arcu pharetra, et aliquam mi molestie. Fusce commodo purus a arcu porta blandit. Integer blandit posuere urna vitae feugiat. Mauris mollis tempus nulla. Aliquam quis lacinia justo, at pellentesque purus. Integer commodo, mi et egestas scelerisque, arcu orci convallis turpis, et blandit dui ante ut turpis. In metus ipsum, imperdiet ut dignissim ac, scelerisque quis purus. Mauris mattis mattis fermentum. Suspendisse a suscipit mi, in interdum massa. Duis magna mi, lacinia bibendum faucibus in, consequat in nisl. Praesent nibh mi, ullamcorper vel fringilla quis, scelerisque eu magna. Vestibulum ipsum purus, eleifend ac mi at, volutpat fermentum sapien. Etiam maximus tortor elementum egestas varius. Aenean sagittis lectus sapien, sed commodo dui consectetur id. Praesent imperdiet, risus at feugiat sodales, elit ex aliquet dui, quis porttitor.\n";
 
-#define MAX_BUF_SIZE sizeof(lorem_ipsum)
-
 /* 256 bytes of binary data */
 static const unsigned char array_256[] = {
 	0x01, 0x02, 0x03, 0x04, 0x05, 0x06, 0x07, 0x08,
@@ -261,6 +269,7 @@ static struct {
 	int len;
 	const unsigned char *buf;
 	bool expecting_reply;
+	uint32_t crc;		/* CRC32C of buf, filled in at startup */
 } data[] = {
 	ENTRY_OK(A),
 	ENTRY_OK(foobar),
@@ -273,6 +282,349 @@ static struct {
 	{ 0, 0 }
 };
 
+enum payload_mode {
+	PAYLOAD_VECTORS,	/* the static data[] entries */
+	PAYLOAD_FIXED,
+	PAYLOAD_SWEEP,
+	PAYLOAD_RANDOM,
+};
+
+/* Generated payloads. The content of packet "seq" is a pure function of
+ * the seed, so the expected bytes can be regenerated when the reply comes
+ * back instead of keeping a copy of everything that was sent.
+ */
+struct payload_gen {
+	enum payload_mode mode;
+	int min;
+	int max;
+	int step;
+	int count;		/* packets per pass */
+	uint64_t seed;
+	uint64_t seq;		/* index of the next generated packet */
+};
+
+static inline uint64_t splitmix64(uint64_t x)
+{
+	x += 0x9e3779b97f4a7c15ULL;
+	x = (x ^ (x >> 30)) * 0xbf58476d1ce4e5b9ULL;
+	x = (x ^ (x >> 27)) * 0x94d049bb133111ebULL;
+
+	return x ^ (x >> 31);
+}
+
+static inline uint64_t payload_key(const struct payload_gen *gen,
+				   uint64_t seq)
+{
+	return splitmix64(gen->seed ^ splitmix64(seq));
+}
+
+/* Return 8 bytes of content for the given 8 byte block of a packet */
+static inline uint64_t payload_block(uint64_t key, uint64_t block)
+{
+	return splitmix64(key + block * 0x9e3779b97f4a7c15ULL);
+}
+
+/* Fill len bytes of packet "seq" starting at byte offset "offset" */
+static void payload_fill(const struct payload_gen *gen, uint64_t seq,
+			 uint64_t offset, unsigned char *buf, int len)
+{
+	uint64_t key = payload_key(gen, seq);
+	int pos = 0;
+
+	while (pos < len) {
+		uint64_t block = payload_block(key, (offset + pos) / 8);
+		int shift = (offset + pos) % 8;
+
+		for (; shift < 8 && pos < len; shift++, pos++)
+			buf[pos] = block >> (shift * 8);
+	}
+}
+
+/* Check received bytes against the regenerated content of packet "seq" */
+static bool payload_verify(const struct payload_gen *gen, uint64_t seq,
+			   uint64_t offset, const unsigned char *buf, int len)
+{
+	unsigned char expected[64];
+	int pos = 0;
+
+	while (pos < len) {
+		int chunk = MIN(len - pos, (int)sizeof(expected));
+
+		payload_fill(gen, seq, offset + pos, expected, chunk);
+		if (memcmp(expected, buf + pos, chunk))
+			return false;
+
+		pos += chunk;
+	}
+
+	return true;
+}
+
+/* Length of the idx'th packet in a pass */
+static int payload_len(const struct payload_gen *gen, int idx)
+{
+	switch (gen->mode) {
+	case PAYLOAD_SWEEP:
+		return gen->min + idx * gen->step;
+	case PAYLOAD_RANDOM:
+		return gen->min + splitmix64(~gen->seed ^ gen->seq) %
+			(gen->max - gen->min + 1);
+	default:
+		return gen->min;
+	}
+}
+
+/* CRC32C (Castagnoli). Slicing-by-8 tables in software, the SSE4.2 crc32
+ * instruction when the CPU has it.
+ */
+#define CRC32C_POLY 0x82f63b78
+
+static uint32_t crc32c_table[8][256];
+
+static uint32_t crc32c_sw(uint32_t crc, const unsigned char *buf, size_t len)
+{
+	crc = ~crc;
+
+#if __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+	while (len >= 8) {
+		uint64_t v;
+
+		memcpy(&v, buf, sizeof(v));
+		v ^= crc;
+
+		crc = crc32c_table[7][v & 0xff] ^
+			crc32c_table[6][(v >> 8) & 0xff] ^
+			crc32c_table[5][(v >> 16) & 0xff] ^
+			crc32c_table[4][(v >> 24) & 0xff] ^
+			crc32c_table[3][(v >> 32) & 0xff] ^
+			crc32c_table[2][(v >> 40) & 0xff] ^
+			crc32c_table[1][(v >> 48) & 0xff] ^
+			crc32c_table[0][v >> 56];
+
+		buf += 8;
+		len -= 8;
+	}
+#endif
+
+	while (len--)
+		crc = crc32c_table[0][(crc ^ *buf++) & 0xff] ^ (crc >> 8);
+
+	return ~crc;
+}
+
+#if defined(__x86_64__)
+#include <nmmintrin.h>
+
+__attribute__((target("sse4.2")))
+static uint32_t crc32c_sse42(uint32_t crc, const unsigned char *buf,
+			     size_t len)
+{
+	uint64_t crc64 = ~crc;
+
+	while (len >= 8) {
+		uint64_t v;
+
+		memcpy(&v, buf, sizeof(v));
+		crc64 = _mm_crc32_u64(crc64, v);
+
+		buf += 8;
+		len -= 8;
+	}
+
+	crc = crc64;
+
+	while (len--)
+		crc = _mm_crc32_u8(crc, *buf++);
+
+	return ~crc;
+}
+#endif
+
+static uint32_t (*crc32c)(uint32_t crc, const unsigned char *buf,
+			  size_t len) = crc32c_sw;
+
+static void crc32c_init(void)
+{
+	int i, j;
+
+	for (i = 0; i < 256; i++) {
+		uint32_t crc = i;
+
+		for (j = 0; j < 8; j++)
+			crc = crc & 1 ? (crc >> 1) ^ CRC32C_POLY : crc >> 1;
+
+		crc32c_table[0][i] = crc;
+	}
+
+	for (i = 0; i < 256; i++)
+		for (j = 1; j < 8; j++)
+			crc32c_table[j][i] = (crc32c_table[j - 1][i] >> 8) ^
+				crc32c_table[0][crc32c_table[j - 1][i] & 0xff];
+
+#if defined(__x86_64__)
+	if (__builtin_cpu_supports("sse4.2"))
+		crc32c = crc32c_sse42;
+#endif
+}
+
+/* Where the bytes of one payload come from: a static buffer or the
+ * generator. TCP payloads are streamed from here chunk by chunk.
+ */
+struct payload_src {
+	const unsigned char *buf;
+	const struct payload_gen *gen;
+	uint64_t seq;
+	int len;
+	uint32_t crc;		/* precomputed digest, if has_crc */
+	bool has_crc;
+};
+
+static const unsigned char *payload_src_get(const struct payload_src *src,
+					    int offset, unsigned char *chunk,
+					    int len)
+{
+	if (src->buf)
+		return src->buf + offset;
+
+	payload_fill(src->gen, src->seq, offset, chunk, len);
+
+	return chunk;
+}
+
+/* Stream a payload to the server without waiting for the echo (flood) */
+static int tcp_send(int fd, const struct payload_src *src)
+{
+	unsigned char chunk[TCP_CHUNK_SIZE];
+	int sent = 0, ret = 0;
+
+	while (sent < src->len) {
+		int len = MIN(src->len - sent, TCP_CHUNK_SIZE);
+		const unsigned char *ptr;
+
+		ptr = payload_src_get(src, sent, chunk, len);
+
+		ret = write(fd, ptr, len);
+		if (ret < 0)
+			return ret;
+
+		sent += ret;
+	}
+
+	return sent;
+}
+
+/* Send a TCP payload and read the echo back at the same time. Received
+ * chunks are folded into a CRC32C as they arrive and compared with the
+ * digest of the sent data, so the echo is never reassembled and the
+ * payload can be much larger than the receive buffer.
+ *
+ * Returns the number of bytes echoed back, 0 on timeout, < 0 on error.
+ */
+static int tcp_echo(int fd, const struct payload_src *src,
+		    unsigned char *buf, int buflen, bool *match)
+{
+	unsigned char chunk[TCP_CHUNK_SIZE];
+	struct pollfd pfd = { .fd = fd };
+	uint32_t tx_crc = 0, rx_crc = 0;
+	int sent = 0, received = 0, ret;
+
+	while (received < src->len) {
+		pfd.events = POLLIN;
+		if (sent < src->len)
+			pfd.events |= POLLOUT;
+
+		ret = poll(&pfd, 1, MAX_TIMEOUT * 1000);
+		if (ret < 0)
+			return -errno;
+		else if (ret == 0)
+			return 0;
+
+		if (pfd.revents & POLLOUT) {
+			int len = MIN(src->len - sent, TCP_CHUNK_SIZE);
+			const unsigned char *ptr;
+
+			ptr = payload_src_get(src, sent, chunk, len);
+
+			ret = send(fd, ptr, len, MSG_DONTWAIT);
+			if (ret < 0 && errno != EAGAIN)
+				return -errno;
+
+			if (ret > 0) {
+				if (!src->has_crc)
+					tx_crc = crc32c(tx_crc, ptr, ret);
+
+				sent += ret;
+			}
+		}
+
+		if (pfd.revents & (POLLIN | POLLHUP | POLLERR)) {
+			ret = read(fd, buf, MIN(buflen, src->len - received));
+			if (ret < 0)
+				return -errno;
+			else if (ret == 0)
+				return -ECONNRESET;
+
+			rx_crc = crc32c(rx_crc, buf, ret);
+			received += ret;
+		}
+	}
+
+	*match = rx_crc == (src->has_crc ? src->crc : tx_crc);
+
+	return received;
+}
+
+/* Parse the -g option:
+ *    fixed:LEN[:COUNT]
+ *    sweep:MIN:MAX[:STEP]
+ *    random:MIN:MAX[:COUNT]
+ */
+static int parse_payload_spec(const char *spec, struct payload_gen *gen,
+			      int max_len)
+{
+	int a = 0, b = 0, c = 0, fields;
+
+	if (!strncmp(spec, "fixed:", 6)) {
+		fields = sscanf(spec + 6, "%d:%d", &a, &c);
+		if (fields < 1)
+			return -EINVAL;
+
+		gen->mode = PAYLOAD_FIXED;
+		gen->min = gen->max = a;
+		gen->count = fields > 1 ? c : DEFAULT_PAYLOAD_COUNT;
+	} else if (!strncmp(spec, "sweep:", 6)) {
+		fields = sscanf(spec + 6, "%d:%d:%d", &a, &b, &c);
+		if (fields < 2)
+			return -EINVAL;
+
+		gen->mode = PAYLOAD_SWEEP;
+		gen->min = a;
+		gen->max = b;
+		gen->step = fields > 2 ? c : 1;
+		if (gen->step <= 0)
+			return -EINVAL;
+
+		gen->count = (b - a) / gen->step + 1;
+	} else if (!strncmp(spec, "random:", 7)) {
+		fields = sscanf(spec + 7, "%d:%d:%d", &a, &b, &c);
+		if (fields < 2)
+			return -EINVAL;
+
+		gen->mode = PAYLOAD_RANDOM;
+		gen->min = a;
+		gen->max = b;
+		gen->count = fields > 2 ? c : DEFAULT_PAYLOAD_COUNT;
+	} else {
+		return -EINVAL;
+	}
+
+	if (gen->min < 1 || gen->max < gen->min || gen->max > max_len ||
+	    gen->count < 1)
+		return -EINVAL;
+
+	return 0;
+}
+
 static int get_ifindex(const char *name)
 {
 	struct ifreq ifr;
@@ -382,6 +734,194 @@ static void signal_handler(int sig)
 	do_exit = true;
 }
 
+static inline uint64_t now_us(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+
+	return (uint64_t)ts.tv_sec * 1000000ULL + ts.tv_nsec / 1000;
+}
+
+/* Per second counters, kept in memory for the results file */
+struct interval {
+	unsigned long long sent;
+	unsigned long long received;
+	unsigned long long bytes;	/* echoed back and verified */
+};
+
+/* Everything that goes to the -o results file, filled in as the test
+ * runs and written out once at the end.
+ */
+static struct {
+	const char *target;
+	int port;
+	bool tcp;
+	bool flood;
+	bool forever;
+	const char *payload;
+	uint64_t seed;
+
+	uint64_t start_us;
+	uint64_t end_us;
+	unsigned long long sent;
+	unsigned long long received;
+	unsigned long long bytes;
+	unsigned long long timeouts;
+	unsigned long long *index_timeouts;	/* per data[] or generated index */
+	int index_count;
+
+	struct latency lat;	/* round trip times in us */
+
+	struct interval *iv;
+	size_t iv_count;
+	size_t iv_alloc;
+} res;
+
+static struct interval *results_interval(uint64_t now)
+{
+	size_t sec = (now - res.start_us) / 1000000;
+
+	if (sec >= res.iv_alloc) {
+		size_t alloc = res.iv_alloc ? res.iv_alloc : 64;
+		struct interval *iv;
+
+		while (alloc <= sec)
+			alloc *= 2;
+
+		iv = realloc(res.iv, alloc * sizeof(*iv));
+		if (!iv)
+			return NULL;
+
+		memset(iv + res.iv_alloc, 0,
+		       (alloc - res.iv_alloc) * sizeof(*iv));
+		res.iv = iv;
+		res.iv_alloc = alloc;
+	}
+
+	if (sec >= res.iv_count)
+		res.iv_count = sec + 1;
+
+	return &res.iv[sec];
+}
+
+static void results_sent(void)
+{
+	struct interval *iv = results_interval(now_us());
+
+	res.sent++;
+	if (iv)
+		iv->sent++;
+}
+
+static void results_received(int len, uint64_t rtt)
+{
+	struct interval *iv = results_interval(now_us());
+
+	res.received++;
+	res.bytes += len;
+	if (iv) {
+		iv->received++;
+		iv->bytes += len;
+	}
+
+	lat_add(&res.lat, rtt);
+}
+
+static void results_timeout(int idx)
+{
+	res.timeouts++;
+
+	if (idx >= 0 && idx < res.index_count)
+		res.index_timeouts[idx]++;
+}
+
+static void write_json(FILE *fp)
+{
+	unsigned long long lost = res.sent - res.received;
+	double secs = (res.end_us - res.start_us) / 1e6;
+	size_t i;
+
+	fprintf(fp, "{\n  \"tool\": \"echo-client\",\n");
+
+	fprintf(fp, "  \"parameters\": {\"target\": ");
+	results_json_string(fp, res.target);
+	fprintf(fp, ", \"port\": %d, \"protocol\": \"%s\", \"flood\": %s, "
+		"\"forever\": %s, \"payload\": ", res.port,
+		res.tcp ? "tcp" : "udp", res.flood ? "true" : "false",
+		res.forever ? "true" : "false");
+	results_json_string(fp, res.payload);
+	fprintf(fp, ", \"seed\": %llu},\n", (unsigned long long)res.seed);
+
+	fprintf(fp, "  \"summary\": {\"duration_s\": %.3f, \"sent\": %llu, "
+		"\"received\": %llu, \"lost\": %llu, \"loss_pct\": %.3f, "
+		"\"timeouts\": %llu, \"bytes\": %llu, \"mbit_s\": %.3f},\n",
+		secs, res.sent, res.received, lost,
+		res.sent ? 100.0 * lost / res.sent : 0, res.timeouts,
+		res.bytes, secs > 0 ? res.bytes * 8 / secs / 1e6 : 0);
+
+	results_json_latency(fp, &res.lat, 1);
+
+	fprintf(fp, "  \"intervals\": [");
+	for (i = 0; i < res.iv_count; i++)
+		fprintf(fp, "%s\n    {\"second\": %zu, \"sent\": %llu, "
+			"\"received\": %llu, \"bytes\": %llu, "
+			"\"mbit_s\": %.3f}", i ? "," : "", i, res.iv[i].sent,
+			res.iv[i].received, res.iv[i].bytes,
+			res.iv[i].bytes * 8 / 1e6);
+	fprintf(fp, "%s],\n", res.iv_count ? "\n  " : "");
+
+	fprintf(fp, "  \"timeouts\": [");
+	for (i = 0; i < (size_t)res.index_count; i++)
+		fprintf(fp, "%s\n    {\"index\": %zu, \"count\": %llu}",
+			i ? "," : "", i, res.index_timeouts[i]);
+	fprintf(fp, "%s]\n}\n", res.index_count ? "\n  " : "");
+}
+
+/* One value per line, so that the file can be loaded as a single table */
+static void write_csv(FILE *fp)
+{
+	unsigned long long lost = res.sent - res.received;
+	double secs = (res.end_us - res.start_us) / 1e6;
+	size_t i;
+
+	fprintf(fp, "section,name,index,value\n");
+
+	fprintf(fp, "parameter,target,,%s\n", res.target);
+	fprintf(fp, "parameter,port,,%d\n", res.port);
+	fprintf(fp, "parameter,protocol,,%s\n", res.tcp ? "tcp" : "udp");
+	fprintf(fp, "parameter,flood,,%d\n", res.flood);
+	fprintf(fp, "parameter,forever,,%d\n", res.forever);
+	fprintf(fp, "parameter,payload,,%s\n", res.payload);
+	fprintf(fp, "parameter,seed,,%llu\n", (unsigned long long)res.seed);
+
+	fprintf(fp, "summary,duration_s,,%.3f\n", secs);
+	fprintf(fp, "summary,sent,,%llu\n", res.sent);
+	fprintf(fp, "summary,received,,%llu\n", res.received);
+	fprintf(fp, "summary,lost,,%llu\n", lost);
+	fprintf(fp, "summary,loss_pct,,%.3f\n",
+		res.sent ? 100.0 * lost / res.sent : 0);
+	fprintf(fp, "summary,timeouts,,%llu\n", res.timeouts);
+	fprintf(fp, "summary,bytes,,%llu\n", res.bytes);
+	fprintf(fp, "summary,mbit_s,,%.3f\n",
+		secs > 0 ? res.bytes * 8 / secs / 1e6 : 0);
+
+	results_csv_latency(fp, &res.lat, 1);
+
+	for (i = 0; i < res.iv_count; i++) {
+		fprintf(fp, "interval,sent,%zu,%llu\n", i, res.iv[i].sent);
+		fprintf(fp, "interval,received,%zu,%llu\n", i,
+			res.iv[i].received);
+		fprintf(fp, "interval,bytes,%zu,%llu\n", i, res.iv[i].bytes);
+		fprintf(fp, "interval,mbit_s,%zu,%.3f\n", i,
+			res.iv[i].bytes * 8 / 1e6);
+	}
+
+	for (i = 0; i < (size_t)res.index_count; i++)
+		fprintf(fp, "timeout,count,%zu,%llu\n", i,
+			res.index_timeouts[i]);
+}
+
 extern int optind, opterr, optopt;
 extern char *optarg;
 
@@ -410,10 +950,14 @@ int main(int argc, char**argv)
 	unsigned long long sum_time = 0ULL;
 	unsigned long long count_time = 0ULL;
 	unsigned long long pkt_counter = 0ULL;
+	struct payload_gen gen = { .mode = PAYLOAD_VECTORS };
+	const char *payload_spec = NULL;
+	const char *results = NULL;
+	uint64_t sent_at;
 
 	opterr = 0;
 
-	while ((c = getopt(argc, argv, "Fi:p:ethr")) != -1) {
+	while ((c = getopt(argc, argv, "Fi:p:ethrg:s:o:")) != -1) {
 		switch (c) {
 		case 'F':
 			flood = true;
@@ -435,6 +979,15 @@ int main(int argc, char**argv)
 			srandom(start_time.tv_usec);
 			do_randomize = true;
 			break;
+		case 'g':
+			payload_spec = optarg;
+			break;
+		case 's':
+			gen.seed = strtoull(optarg, NULL, 0);
+			break;
+		case 'o':
+			results = optarg;
+			break;
 		case 'h':
 			help = true;
 			break;
@@ -444,6 +997,14 @@ int main(int argc, char**argv)
 	if (optind < argc)
 		target = argv[optind];
 
+	if (payload_spec &&
+	    parse_payload_spec(payload_spec, &gen,
+			       tcp ? MAX_STREAM_SIZE : MAX_BUF_SIZE) < 0) {
+		printf("Invalid payload specification \"%s\"\n",
+		       payload_spec);
+		help = true;
+	}
+
 	if (!target || help) {
 		printf("usage: %s [-i iface] [-F] <IPv{6|4} address of the echo-server>\n",
 		       argv[0]);
@@ -453,15 +1014,51 @@ int main(int argc, char**argv)
 		printf("-t Use TCP, default is to use UDP only\n");
 		printf("-p Use this port, default port is %d\n", SERVER_PORT);
 		printf("-r Send random packet lengths\n");
+		printf("-g Generate payloads instead of using the built-in "
+		       "test vectors:\n"
+		       "   fixed:LEN[:COUNT], sweep:MIN:MAX[:STEP] or "
+		       "random:MIN:MAX[:COUNT]\n"
+		       "   LEN is at most %d bytes (%d with -t), "
+		       "COUNT defaults to %d\n",
+		       MAX_BUF_SIZE, MAX_STREAM_SIZE, DEFAULT_PAYLOAD_COUNT);
+		printf("-s Seed for the generated payload content\n");
 		printf("-F (flood) option will prevent the client from "
 		       "waiting the data.\n"
 		       "   The -F option will stress test the server.\n");
+		printf("-o Write the results to this file at exit, as CSV "
+		       "if it ends in .csv\n"
+		       "   and as JSON otherwise\n");
 		exit(-EINVAL);
 	}
 
 	signal(SIGINT, signal_handler);
 	signal(SIGTERM, signal_handler);
 
+	crc32c_init();
+
+	for (i = 0; data[i].buf; i++)
+		data[i].crc = crc32c(0, data[i].buf, data[i].len);
+
+	res.target = target;
+	res.port = port;
+	res.tcp = tcp;
+	res.flood = flood;
+	res.forever = forever;
+	res.payload = payload_spec ? payload_spec :
+		do_randomize ? "random" : "vectors";
+	res.seed = gen.seed;
+
+	/* Random lengths from -r are not tied to an index */
+	if (!do_randomize) {
+		res.index_count = gen.mode != PAYLOAD_VECTORS ? gen.count : i;
+		res.index_timeouts = calloc(res.index_count,
+					    sizeof(*res.index_timeouts));
+		if (!res.index_timeouts)
+			res.index_count = 0;
+	}
+
+	i = 0;
+
 	if (inet_pton(AF_INET6, target, &addr6_send.sin6_addr) != 1) {
 		if (inet_pton(AF_INET, target, &addr4_send.sin_addr) != 1) {
 			printf("Invalid address family\n");
@@ -565,21 +1162,38 @@ int main(int argc, char**argv)
 		}
 	}
 
+	res.start_us = now_us();
+
 again:
 	do {
-		int sent;
-
-		while (data[i].buf) {
-			const unsigned char *buf_ptr;
-			int pos = 0;
+		while (gen.mode != PAYLOAD_VECTORS ? i < gen.count :
+		       data[i].buf != NULL) {
+			struct payload_src src = { 0 };
+			bool expecting_reply, match = false;
 			int len;
 
-			sent = 0;
-
 			gettimeofday(&start_time, NULL);
+			sent_at = now_us();
+
+			if (gen.mode != PAYLOAD_VECTORS) {
+				len = payload_len(&gen, i);
+				if (!tcp)
+					len = MIN(MAX_UDP_PAYLOAD, len);
+
+				src.gen = &gen;
+				src.seq = gen.seq++;
 
-			if (do_randomize) {
-				buf_ptr = lorem_ipsum;
+				/* UDP replies are received into the same
+				 * buffer and checked against regenerated
+				 * content, TCP payloads are generated while
+				 * they are streamed.
+				 */
+				if (!tcp) {
+					payload_fill(&gen, src.seq, 0, buf, len);
+					src.buf = buf;
+				}
+			} else if (do_randomize) {
+				src.buf = lorem_ipsum;
 
 				/* For UDP, we send max 1280 bytes which is
 				 * the IPv6 MTU size
@@ -593,107 +1207,124 @@ again:
 				if (len == 0)
 					len = 1;
 			} else {
-				if (tcp)
+				if (tcp) {
 					len = data[i].len;
-				else
+					src.crc = data[i].crc;
+					src.has_crc = true;
+				} else {
 					len = MIN(1280, data[i].len);
+				}
 
-				buf_ptr = data[i].buf;
+				src.buf = data[i].buf;
 			}
 
-			if (tcp) {
-				pos = 0;
-
-				do {
-					ret = write(fd, &buf_ptr[pos],
-						    len - pos);
-					if (ret <= 0)
-						break;
-
-					sent += len;
-					pos += ret;
-				} while (sent < len);
-			} else
-				ret = sendto(fd, buf_ptr, len, 0, addr_send,
-					     addr_len);
-			if (ret < 0) {
-				perror("send");
-				goto out;
-			}
+			src.len = len;
+
+			expecting_reply = gen.mode != PAYLOAD_VECTORS ||
+				do_randomize || data[i].expecting_reply;
+
+			if (tcp && !flood) {
+				ret = tcp_echo(fd, &src, buf, sizeof(buf),
+					       &match);
+				if (ret < 0) {
+					if (ret == -ECONNRESET)
+						printf("Connection closed by "
+						       "peer.\n");
+					else if (!do_exit)
+						fprintf(stderr, "TCP echo "
+							"failed: %s\n",
+							strerror(-ret));
+
+					ret = -EINVAL;
+					goto out;
+				}
 
-			if (flood) {
-				i++;
-				continue;
-			}
+				results_sent();
+			} else {
+				if (tcp)
+					ret = tcp_send(fd, &src);
+				else
+					ret = sendto(fd, src.buf, len, 0,
+						     addr_send, addr_len);
+				if (ret < 0) {
+					perror("send");
+					goto out;
+				}
 
-			FD_ZERO(&rfds);
-			FD_SET(fd, &rfds);
+				results_sent();
 
-			if (do_randomize || data[i].expecting_reply) {
-				tv.tv_sec = MAX_TIMEOUT;
-				tv.tv_usec = 0;
-			} else {
-				tv.tv_sec = 0;
-				tv.tv_usec = 0;
-			}
+				if (flood) {
+					i++;
+					continue;
+				}
 
-			ret = select(fd + 1, &rfds, NULL, NULL, &tv);
-			if (ret < 0) {
-				if (!do_exit) {
-					perror("select");
+				FD_ZERO(&rfds);
+				FD_SET(fd, &rfds);
+
+				if (expecting_reply) {
+					tv.tv_sec = MAX_TIMEOUT;
+					tv.tv_usec = 0;
+				} else {
+					tv.tv_sec = 0;
+					tv.tv_usec = 0;
 				}
 
-				goto out;
-			} else if (ret == 0) {
+				ret = select(fd + 1, &rfds, NULL, NULL, &tv);
+				if (ret < 0) {
+					if (!do_exit) {
+						perror("select");
+					}
+
+					goto out;
+				} else if (ret > 0) {
+					if (!FD_ISSET(fd, &rfds)) {
+						fprintf(stderr,
+							"Invalid fd\n");
+						ret = i;
+						goto out;
+					}
+
+					ret = recv(fd, buf, sizeof(buf), 0);
+					if (ret <= 0) {
+						if (ret)
+							perror("recv");
+						else
+							printf("Connection "
+							       "closed by "
+							       "peer.\n");
+
+						ret = -EINVAL;
+						goto out;
+					}
+
+					match = len == ret &&
+						(src.gen ?
+						 payload_verify(&gen, src.seq,
+								0, buf, ret) :
+						 !memcmp(src.buf, buf, ret));
+				}
+			}
+
+			if (ret == 0) {
 				if (do_randomize) {
+					results_timeout(-1);
 					timeout++;
 					continue;
 				}
 
-				if (data[i].expecting_reply) {
+				if (expecting_reply) {
 					fprintf(stderr,
 						"Timeout while waiting "
 						"idx %d len %d\n",
-						i, data[i].len);
+						i, len);
 					timeout = i;
+					results_timeout(i);
 				}
 				i++;
 				continue;
-			} else if (!FD_ISSET(fd, &rfds)) {
-				fprintf(stderr, "Invalid fd\n");
-				ret = i;
-				goto out;
-			}
-
-			if (tcp) {
-				int received = 0;
-
-				pos = 0;
-
-				do {
-					ret = read(fd, buf + pos,
-						   sizeof(buf) - pos);
-					if (ret <= 0)
-						break;
-
-					received += ret;
-					pos += ret;
-					ret = received;
-				} while (received < sent);
-			} else
-				ret = recv(fd, buf, sizeof(buf), 0);
-			if (ret <= 0) {
-				if (ret)
-					perror("recv");
-				else
-					printf("Connection closed by peer.\n");
-
-				ret = -EINVAL;
-				goto out;
 			}
 
-			if (len != ret ||
-			    memcmp(buf_ptr, buf, ret) != 0) {
+			if (!match) {
 				fprintf(stderr,
 					"Check failed idx %d len %d\n",
 					i, ret);
@@ -711,6 +1342,8 @@ again:
 				count_time++;
 				pkt_counter++;
 
+				results_received(len, now_us() - sent_at);
+
 				printf(".");
 
 				/* Flush stdout only every 10 packets */
@@ -742,6 +1375,11 @@ again:
 	printf("\n");
 
 out:
+	if (results) {
+		res.end_us = now_us();
+		results_write(results, write_json, write_csv);
+	}
+
 	if (count_time > 0ULL) {
 		unsigned long long time_spent;
 		unsigned long long ms;
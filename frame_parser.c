@@ -0,0 +1,156 @@
+/*
+ * Copyright (c) 2015 Intel Corporation.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <string.h>
+
+#include "frame_parser.h"
+
+enum frame_class {
+	FRAME_CLASS_OTHER,
+	FRAME_CLASS_ZERO,
+	FRAME_CLASS_START,
+	FRAME_CLASS_COUNT,
+};
+
+static const uint8_t frame_class[256] = {
+	[0x00] = FRAME_CLASS_ZERO,
+	[FRAME_START] = FRAME_CLASS_START,
+};
+
+/* Transitions out of the states before the PSDU. In the data state the
+ * byte class does not matter, only the count does.
+ */
+static const struct {
+	uint8_t next;
+	uint8_t event;
+} frame_table[FRAME_STATE_DATA][FRAME_CLASS_COUNT] = {
+	[FRAME_STATE_IDLE] = {
+		[FRAME_CLASS_OTHER] = { FRAME_STATE_IDLE, FRAME_EVENT_GARBAGE },
+		[FRAME_CLASS_ZERO] = { FRAME_STATE_IDLE, FRAME_EVENT_SYNC },
+		[FRAME_CLASS_START] = { FRAME_STATE_LEN, FRAME_EVENT_START },
+	},
+	[FRAME_STATE_LEN] = {
+		[FRAME_CLASS_OTHER] = { FRAME_STATE_DATA, FRAME_EVENT_LEN },
+		[FRAME_CLASS_ZERO] = { FRAME_STATE_IDLE, FRAME_EVENT_FRAME },
+		[FRAME_CLASS_START] = { FRAME_STATE_DATA, FRAME_EVENT_LEN },
+	},
+};
+
+void frame_parser_init(struct frame_parser *parser)
+{
+	memset(parser, 0, sizeof(*parser));
+}
+
+static void frame_done(struct frame_parser *parser)
+{
+	parser->state = FRAME_STATE_IDLE;
+	parser->stats.frames++;
+	parser->stats.bytes += parser->len;
+}
+
+enum frame_event frame_parser_step(struct frame_parser *parser,
+				   uint8_t byte)
+{
+	enum frame_event event;
+
+	if (parser->state == FRAME_STATE_DATA) {
+		parser->frame[parser->offset++] = byte;
+
+		if (parser->offset < parser->len)
+			return FRAME_EVENT_DATA;
+
+		frame_done(parser);
+
+		return FRAME_EVENT_FRAME;
+	}
+
+	event = frame_table[parser->state][frame_class[byte]].event;
+	parser->state = frame_table[parser->state][frame_class[byte]].next;
+
+	switch (event) {
+	case FRAME_EVENT_SYNC:
+		parser->stats.sync++;
+		break;
+	case FRAME_EVENT_GARBAGE:
+		parser->stats.garbage++;
+		parser->in_garbage = true;
+		break;
+	case FRAME_EVENT_START:
+		if (parser->in_garbage)
+			parser->stats.resyncs++;
+		parser->in_garbage = false;
+		break;
+	case FRAME_EVENT_LEN:
+		parser->len = byte;
+		parser->offset = 0;
+		break;
+	case FRAME_EVENT_FRAME:
+		/* Empty frame, complete with its length byte */
+		parser->len = 0;
+		frame_done(parser);
+		break;
+	default:
+		break;
+	}
+
+	return event;
+}
+
+size_t frame_parser_feed(struct frame_parser *parser, const uint8_t *buf,
+			 size_t len, frame_parser_cb cb, void *user_data)
+{
+	const uint8_t *frame;
+	size_t i = 0, idle = 0, n;
+
+	while (i < len) {
+		if (parser->state != FRAME_STATE_DATA) {
+			if (frame_parser_step(parser, buf[i++]) ==
+			    FRAME_EVENT_FRAME && cb)
+				cb(parser->frame, 0, user_data);
+
+			if (parser->state == FRAME_STATE_IDLE)
+				idle = i;
+
+			continue;
+		}
+
+		/* The PSDU in bulk, copied only if it spans chunks */
+		n = parser->len - parser->offset;
+		if (n > len - i)
+			n = len - i;
+
+		if (parser->offset == 0 && n == parser->len) {
+			frame = buf + i;
+		} else {
+			memcpy(parser->frame + parser->offset, buf + i, n);
+			frame = parser->frame;
+		}
+
+		parser->offset += n;
+		i += n;
+
+		if (parser->offset < parser->len)
+			break;
+
+		frame_done(parser);
+		idle = i;
+
+		if (cb)
+			cb(frame, parser->len, user_data);
+	}
+
+	return idle;
+}
@@ -0,0 +1,92 @@
+/*
+ * Copyright (c) 2015 Intel Corporation.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef FRAME_PARSER_H
+#define FRAME_PARSER_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+/* Framing used by the Zephyr dummy 15.4 radio over a pipe: a 0xF0 start
+ * byte, a length byte and that many bytes of PSDU. Zero bytes between
+ * frames are sync bytes, anything else between frames is garbage and is
+ * skipped until the next start byte.
+ */
+#define FRAME_START	0xF0
+#define FRAME_MAX	255
+
+enum frame_state {
+	FRAME_STATE_IDLE,	/* between frames */
+	FRAME_STATE_LEN,	/* start byte seen */
+	FRAME_STATE_DATA,	/* length seen, reading the PSDU */
+	FRAME_STATE_COUNT,
+};
+
+enum frame_event {
+	FRAME_EVENT_SYNC,	/* zero byte between frames */
+	FRAME_EVENT_GARBAGE,	/* other byte between frames */
+	FRAME_EVENT_START,
+	FRAME_EVENT_LEN,
+	FRAME_EVENT_DATA,
+	FRAME_EVENT_FRAME,	/* last byte of a frame */
+};
+
+struct frame_stats {
+	unsigned long long frames;
+	unsigned long long bytes;	/* PSDU bytes of complete frames */
+	unsigned long long sync;
+	unsigned long long garbage;
+	unsigned long long resyncs;	/* garbage runs ended by a frame */
+};
+
+/* No allocation: the PSDU of a frame split over several chunks is
+ * gathered in frame, a frame that is whole in one chunk is passed to
+ * the caller in place.
+ */
+struct frame_parser {
+	uint8_t state;
+	uint8_t len;
+	uint8_t offset;
+	bool in_garbage;
+	uint8_t frame[FRAME_MAX];
+	struct frame_stats stats;
+};
+
+typedef void (*frame_parser_cb)(const uint8_t *frame, size_t len,
+				void *user_data);
+
+void frame_parser_init(struct frame_parser *parser);
+
+/* Byte at a time. The frame is in parser->frame, parser->len bytes
+ * long, when FRAME_EVENT_FRAME is returned.
+ */
+enum frame_event frame_parser_step(struct frame_parser *parser,
+				   uint8_t byte);
+
+/* Parse a chunk and call cb for each complete frame in it. Returns the
+ * length of the chunk up to the last point where the parser was between
+ * frames, 0 if there was none.
+ */
+size_t frame_parser_feed(struct frame_parser *parser, const uint8_t *buf,
+			 size_t len, frame_parser_cb cb, void *user_data);
+
+static inline bool frame_parser_idle(const struct frame_parser *parser)
+{
+	return parser->state == FRAME_STATE_IDLE;
+}
+
+#endif /* FRAME_PARSER_H */
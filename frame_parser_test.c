@@ -0,0 +1,271 @@
+/*
+ * Copyright (c) 2015 Intel Corporation.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/* Feeds random streams to the frame parser: frames with sync bytes and
+ * garbage between them, whose frames and counters are known, and plain
+ * random bytes. Every stream is parsed a byte at a time and in random
+ * chunks, and both have to give the same frames and counters.
+ *
+ * usage: frame_parser_test [seed] [streams]
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "frame_parser.h"
+
+#define STREAM_MAX	(1024 * 1024)
+#define FRAMES_MAX	4096
+
+struct frames {
+	size_t count;
+	size_t len[FRAMES_MAX];
+	uint8_t psdu[FRAMES_MAX][FRAME_MAX];
+};
+
+static uint64_t rng_state;
+
+/* xorshift64*, so that a seed gives the same streams everywhere */
+static uint32_t rng(void)
+{
+	rng_state ^= rng_state >> 12;
+	rng_state ^= rng_state << 25;
+	rng_state ^= rng_state >> 27;
+
+	return (rng_state * 0x2545f4914f6cdd1dULL) >> 32;
+}
+
+static uint8_t stream[STREAM_MAX];
+static struct frames expected, stepped, fed;
+
+static void frames_add(struct frames *f, const uint8_t *psdu, size_t len)
+{
+	if (f->count == FRAMES_MAX)
+		return;
+
+	f->len[f->count] = len;
+	memcpy(f->psdu[f->count], psdu, len);
+	f->count++;
+}
+
+static void frame_cb(const uint8_t *psdu, size_t len, void *user_data)
+{
+	frames_add(user_data, psdu, len);
+}
+
+/* A byte between frames that is neither a sync byte nor a start byte */
+static uint8_t garbage_byte(void)
+{
+	uint8_t b;
+
+	do
+		b = rng();
+	while (b == 0 || b == FRAME_START);
+
+	return b;
+}
+
+/* Frames with runs of sync bytes and garbage between them. Fills in the
+ * frames and the counters the parser has to end up with.
+ */
+static size_t make_stream(struct frame_stats *stats)
+{
+	size_t len = 0;
+	int i, n;
+
+	memset(stats, 0, sizeof(*stats));
+	expected.count = 0;
+
+	while (expected.count < FRAMES_MAX &&
+	       len + 3 * FRAME_MAX < STREAM_MAX) {
+		bool garbage = false;
+		uint8_t *psdu;
+		size_t flen;
+
+		switch (rng() % 4) {
+		case 0:
+			n = rng() % 8;
+			for (i = 0; i < n; i++)
+				stream[len++] = 0;
+			stats->sync += n;
+			break;
+		case 1:
+			n = 1 + rng() % 32;
+			for (i = 0; i < n; i++)
+				stream[len++] = garbage_byte();
+			stats->garbage += n;
+			garbage = true;
+			break;
+		}
+
+		/* a short stream may end in garbage, which is no resync */
+		if (rng() % 64 == 0)
+			break;
+
+		if (garbage)
+			stats->resyncs++;
+
+		flen = rng() % 8 ? rng() % 128 : rng() % (FRAME_MAX + 1);
+		stream[len++] = FRAME_START;
+		stream[len++] = flen;
+
+		psdu = stream + len;
+		for (i = 0; i < (int)flen; i++)
+			stream[len++] = rng();
+
+		frames_add(&expected, psdu, flen);
+		stats->frames++;
+		stats->bytes += flen;
+	}
+
+	return len;
+}
+
+static void parse_stepped(const uint8_t *buf, size_t len,
+			  struct frame_parser *parser)
+{
+	size_t i;
+
+	frame_parser_init(parser);
+	stepped.count = 0;
+
+	for (i = 0; i < len; i++)
+		if (frame_parser_step(parser, buf[i]) == FRAME_EVENT_FRAME)
+			frames_add(&stepped, parser->frame, parser->len);
+}
+
+/* Random chunks, each checked to report where the parser was last idle */
+static int parse_fed(const uint8_t *buf, size_t len,
+		     struct frame_parser *parser)
+{
+	size_t pos = 0, chunk, idle;
+
+	frame_parser_init(parser);
+	fed.count = 0;
+
+	while (pos < len) {
+		chunk = rng() % 4 ? 1 + rng() % 600 : 1 + rng() % 4;
+		if (chunk > len - pos)
+			chunk = len - pos;
+
+		idle = frame_parser_feed(parser, buf + pos, chunk, frame_cb,
+					 &fed);
+
+		if (idle > chunk ||
+		    (frame_parser_idle(parser) && idle != chunk)) {
+			printf("feed returned %zu for a chunk of %zu\n", idle,
+			       chunk);
+			return -1;
+		}
+
+		pos += chunk;
+	}
+
+	return 0;
+}
+
+static int frames_equal(const struct frames *a, const struct frames *b)
+{
+	size_t i;
+
+	if (a->count != b->count)
+		return 0;
+
+	for (i = 0; i < a->count; i++)
+		if (a->len[i] != b->len[i] ||
+		    memcmp(a->psdu[i], b->psdu[i], a->len[i]))
+			return 0;
+
+	return 1;
+}
+
+static int stats_equal(const struct frame_stats *a,
+		       const struct frame_stats *b)
+{
+	return a->frames == b->frames && a->bytes == b->bytes &&
+		a->sync == b->sync && a->garbage == b->garbage &&
+		a->resyncs == b->resyncs;
+}
+
+static void print_stats(const char *name, const struct frame_stats *s)
+{
+	printf("  %-8s frames %llu bytes %llu sync %llu garbage %llu "
+	       "resyncs %llu\n", name, s->frames, s->bytes, s->sync,
+	       s->garbage, s->resyncs);
+}
+
+static int check_stream(const uint8_t *buf, size_t len,
+			const struct frame_stats *want)
+{
+	struct frame_parser step_parser, feed_parser;
+
+	parse_stepped(buf, len, &step_parser);
+	if (parse_fed(buf, len, &feed_parser) < 0)
+		return -1;
+
+	if (!frames_equal(&stepped, &fed) ||
+	    !stats_equal(&step_parser.stats, &feed_parser.stats)) {
+		printf("byte-wise and chunked parsing differ\n");
+		print_stats("stepped", &step_parser.stats);
+		print_stats("fed", &feed_parser.stats);
+		return -1;
+	}
+
+	if (want && (!frames_equal(&expected, &stepped) ||
+		     !stats_equal(want, &step_parser.stats))) {
+		printf("frames or counters differ from the stream\n");
+		print_stats("expected", want);
+		print_stats("parsed", &step_parser.stats);
+		return -1;
+	}
+
+	return 0;
+}
+
+int main(int argc, char **argv)
+{
+	unsigned long long seed = argc > 1 ? strtoull(argv[1], NULL, 0) : 1;
+	int streams = argc > 2 ? atoi(argv[2]) : 200;
+	struct frame_stats want;
+	size_t len, i;
+	int n;
+
+	rng_state = seed ? seed : 1;
+
+	for (n = 0; n < streams; n++) {
+		len = make_stream(&want);
+		if (check_stream(stream, len, &want) < 0)
+			goto fail;
+
+		/* anything at all, the parser must not go astray */
+		len = rng() % STREAM_MAX;
+		for (i = 0; i < len; i++)
+			stream[i] = rng();
+		if (check_stream(stream, len, NULL) < 0)
+			goto fail;
+	}
+
+	printf("frame_parser_test: %d streams ok\n", streams);
+
+	return 0;
+
+fail:
+	printf("frame_parser_test: failed on stream %d of seed %llu\n", n,
+	       seed);
+
+	return 1;
+}
@@ -27,31 +27,133 @@
 #include <fcntl.h>
 #include <signal.h>
 #include <sys/uio.h>
+#include <sys/stat.h>
+#include <sys/socket.h>
+#include <sys/un.h>
 #include <sys/signalfd.h>
+#include <sys/epoll.h>
 #include <sys/time.h>
+#include <time.h>
+#include <netinet/in.h>
 #include <linux/if_ether.h>
 #include <glib.h>
 #include <pcap/pcap.h>
 
+#include "frame_parser.h"
+
 #define PIPE_IN		".in"
 #define PIPE_OUT	".out"
-#define DUMMY_RADIO_15_4_FRAME_TYPE     0xF0
 
-static uint8_t input1[128];
-static uint8_t input1_len, input1_offset, input1_type;
+#define PCAP_FLUSH_SIZE		32768	/* flush when this much is staged */
+#define PCAP_FLUSH_MS		100	/* or when the oldest frame is this old */
+
+#define PIPE_READ_SIZE	4096	/* bytes forwarded per wakeup */
+#define MAX_EVENTS	16
+#define SIGNAL_EVENT	UINT32_MAX	/* epoll tag of the signalfd */
+#define LISTEN_EVENT	(UINT32_MAX - 1)	/* and of the viewer socket */
+#define CLIENT_EVENT	0x80000000	/* ORed with the viewer slot */
+
+#define MAX_CLIENTS	8	/* live viewers at a time */
+
+#define PIPE_PENDING_SIZE 512	/* bytes held back to end on a frame */
+
+/* One emulated radio. Whatever it writes to its .out pipe is forwarded
+ * as is to the .in pipes of all the other nodes, and parsed into frames
+ * for the capture on the way. The bytes are cut at frame boundaries so
+ * that the output of several nodes never interleaves within a frame.
+ */
+struct monitor_node {
+	int id;
+	char *pipe_in;
+	char *pipe_out;
+	int fd_in;
+	int fd_out;
+
+	uint8_t pending[PIPE_PENDING_SIZE];
+	size_t pending_len;
+
+	struct frame_parser parser;
+};
 
-static uint8_t input2[128];
-static uint8_t input2_len, input2_offset, input2_type;
+static struct monitor_node *nodes;
+static int node_count;
 
-static GMainLoop *main_loop = NULL;
+static int epoll_fd = -1;
+static bool running;
 static char *path = NULL;
-static char *pipe_1_in = NULL, *pipe_1_out = NULL;
-static char *pipe_2_in = NULL, *pipe_2_out = NULL;
 static struct pcap_fd *pcap;
-static int fd1_in = -1, fd2_in = -1;
 
-struct pcap_fd {
+static size_t flush_size = PCAP_FLUSH_SIZE;
+static unsigned int flush_ms = PCAP_FLUSH_MS;
+static unsigned int sync_secs;
+
+/* An IEEE 802.15.4 address as it is in the frame, little endian */
+struct mac_addr {
+	uint8_t mode;			/* MAC_ADDR_* */
+	uint8_t addr[8];
+};
+
+#define MAC_ADDR_NONE	0
+#define MAC_ADDR_SHORT	2
+#define MAC_ADDR_EXT	3
+
+/* Only the frames that match every field set in fields are captured,
+ * and of those only one in sample.
+ */
+struct frame_filter {
+	unsigned int fields;
+#define FILTER_TYPE	(1 << 0)
+#define FILTER_PAN	(1 << 1)
+#define FILTER_SRC	(1 << 2)
+#define FILTER_DST	(1 << 3)
+#define FILTER_DISPATCH	(1 << 4)
+	uint8_t type;
+	uint16_t pan;
+	struct mac_addr src;
+	struct mac_addr dst;
+	uint8_t dispatch;
+	uint8_t dispatch_mask;
+	unsigned int sample;
+
+	unsigned long long matched;
+	unsigned long long dropped;
+};
+
+static struct frame_filter filter;
+
+/* A live viewer, e.g. Wireshark reading a FIFO, stdout or a socket.
+ * It is never waited for: what does not fit in the pipe or socket is
+ * kept in pending, and whatever is flushed before that has drained is
+ * dropped for this viewer. Every flush is made of whole records, so the
+ * viewer misses frames but never sees a broken one.
+ */
+struct pcap_client {
 	int fd;
+	uint8_t *pending;
+	size_t pending_len;
+	size_t pending_off;
+	unsigned long long dropped;	/* bytes */
+};
+
+/* Captured frames are staged in buf, record header and data back to
+ * back, and written out with a single write() once flush_size bytes or
+ * flush_ms milliseconds have accumulated. The file header is kept in
+ * header for the viewers that connect later.
+ */
+struct pcap_fd {
+	int fd;			/* capture file, -1 when only streaming */
+	int listen_fd;
+	char *unix_path;
+	struct pcap_client clients[MAX_CLIENTS];
+	uint8_t *header;
+	size_t header_len;
+	bool header_done;
+	uint8_t *buf;
+	size_t len;
+	size_t size;
+	bool pcapng;
+	uint64_t flush_at;	/* deadlines in ms, 0 if not armed */
+	uint64_t sync_at;
 };
 
 #define PCAP_FILE_HDR_SIZE (sizeof(struct pcap_file_header))
@@ -64,6 +166,29 @@ struct pcap_frame {
 } __attribute__ ((packed));
 #define PCAP_FRAME_SIZE (sizeof(struct pcap_frame))
 
+#define PCAP_SNAPLEN	0x0000ffff
+/*
+ * http://www.tcpdump.org/linktypes.html
+ * LINKTYPE_IEEE802_15_4_NOFCS : 230
+ */
+#define LINKTYPE_IEEE802_15_4_NOFCS	0x000000E6
+
+/* https://www.ietf.org/archive/id/draft-ietf-opsawg-pcapng */
+#define PCAPNG_SHB	0x0A0D0D0A
+#define PCAPNG_IDB	0x00000001
+#define PCAPNG_EPB	0x00000006
+#define PCAPNG_BOM	0x1A2B3C4D
+
+#define PCAPNG_OPT_END		0
+#define PCAPNG_OPT_SHB_USERAPPL	4
+#define PCAPNG_OPT_IF_NAME	2
+#define PCAPNG_OPT_IF_TSRESOL	9
+
+#define PCAPNG_PAD(len)	(((len) + 3) & ~3)
+#define PCAPNG_EPB_SIZE	32	/* block without the packet data */
+
+#define PCAP_RECORD_MAX	(PCAPNG_EPB_SIZE + PCAPNG_PAD(PCAP_SNAPLEN))
+
 struct debug_desc {
 	const char *name;
 	const char *file;
@@ -109,30 +234,449 @@ void log_cleanup(void)
 	closelog();
 }
 
+static uint64_t now_ms(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+
+	return (uint64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+static void pcap_client_close(struct pcap_client *client)
+{
+	DBG("Viewer fd %d gone, %llu bytes dropped", client->fd,
+	    client->dropped);
+
+	epoll_ctl(epoll_fd, EPOLL_CTL_DEL, client->fd, NULL);
+	close(client->fd);
+	g_free(client->pending);
+
+	memset(client, 0, sizeof(*client));
+	client->fd = -1;
+}
+
+/* Only wake up for a viewer that has something pending */
+static void pcap_client_watch(int slot)
+{
+	struct pcap_client *client = &pcap->clients[slot];
+	struct epoll_event ev = { .data.u32 = CLIENT_EVENT | slot };
+
+	ev.events = client->pending_len ? EPOLLOUT : 0;
+
+	epoll_ctl(epoll_fd, EPOLL_CTL_MOD, client->fd, &ev);
+}
+
+/* Returns false if the viewer went away */
+static bool pcap_client_drain(struct pcap_client *client)
+{
+	ssize_t ret;
+
+	while (client->pending_off < client->pending_len) {
+		ret = write(client->fd, client->pending + client->pending_off,
+			    client->pending_len - client->pending_off);
+		if (ret < 0 && errno == EINTR)
+			continue;
+
+		if (ret < 0 && errno == EAGAIN)
+			return true;
+
+		if (ret <= 0)
+			return false;
+
+		client->pending_off += ret;
+	}
+
+	g_free(client->pending);
+	client->pending = NULL;
+	client->pending_len = client->pending_off = 0;
+
+	return true;
+}
+
+static void pcap_client_send(int slot, const uint8_t *buf, size_t len)
+{
+	struct pcap_client *client = &pcap->clients[slot];
+	bool pending = client->pending_len;
+	ssize_t ret;
+
+	if (!len)
+		return;
+
+	if (!pcap_client_drain(client))
+		goto gone;
+
+	if (client->pending_len) {
+		client->dropped += len;
+		return;
+	}
+
+	while (len) {
+		ret = write(client->fd, buf, len);
+		if (ret < 0 && errno == EINTR)
+			continue;
+
+		if (ret < 0 && errno == EAGAIN)
+			break;
+
+		if (ret <= 0)
+			goto gone;
+
+		buf += ret;
+		len -= ret;
+	}
+
+	if (len) {
+		client->pending = g_malloc(len);
+		memcpy(client->pending, buf, len);
+		client->pending_len = len;
+	}
+
+	if (pending != !!client->pending_len)
+		pcap_client_watch(slot);
+
+	return;
+
+gone:
+	pcap_client_close(client);
+}
+
+static void pcap_client_event(int slot, uint32_t events)
+{
+	struct pcap_client *client = &pcap->clients[slot];
+
+	if (client->fd < 0)
+		return;
+
+	if (events & (EPOLLERR | EPOLLHUP) || !pcap_client_drain(client)) {
+		pcap_client_close(client);
+		return;
+	}
+
+	if (!client->pending_len)
+		pcap_client_watch(slot);
+}
+
+static bool pcap_client_add(int fd)
+{
+	struct epoll_event ev = { .events = 0 };
+	int slot;
+
+	for (slot = 0; slot < MAX_CLIENTS; slot++)
+		if (pcap->clients[slot].fd < 0)
+			break;
+
+	if (slot == MAX_CLIENTS) {
+		DBG("Too many viewers, closing fd %d", fd);
+		close(fd);
+		return false;
+	}
+
+	ev.data.u32 = CLIENT_EVENT | slot;
+
+	if (fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK) < 0 ||
+	    epoll_ctl(epoll_fd, EPOLL_CTL_ADD, fd, &ev) < 0) {
+		DBG("Failed to watch viewer fd %d (%s)", fd, strerror(errno));
+		close(fd);
+		return false;
+	}
+
+	DBG("Viewer on fd %d", fd);
+
+	pcap->clients[slot].fd = fd;
+	pcap_client_send(slot, pcap->header, pcap->header_len);
+
+	return true;
+}
+
+static void pcap_accept(void)
+{
+	int fd;
+
+	fd = accept(pcap->listen_fd, NULL, NULL);
+	if (fd < 0) {
+		DBG("Failed to accept viewer (%s)", strerror(errno));
+		return;
+	}
+
+	pcap_client_add(fd);
+}
+
+/* tcp:PORT on the loopback address or unix:PATH */
+static bool pcap_listen(const char *spec)
+{
+	struct epoll_event ev = { .events = EPOLLIN,
+				  .data.u32 = LISTEN_EVENT };
+	union {
+		struct sockaddr sa;
+		struct sockaddr_in in;
+		struct sockaddr_un un;
+	} addr;
+	socklen_t addrlen;
+	int fd, one = 1;
+
+	memset(&addr, 0, sizeof(addr));
+
+	if (!strncmp(spec, "unix:", 5)) {
+		if (strlen(spec + 5) >= sizeof(addr.un.sun_path)) {
+			DBG("Socket path %s too long", spec + 5);
+			return false;
+		}
+
+		addr.un.sun_family = AF_UNIX;
+		strcpy(addr.un.sun_path, spec + 5);
+		addrlen = sizeof(addr.un);
+
+		unlink(addr.un.sun_path);
+	} else {
+		addr.in.sin_family = AF_INET;
+		addr.in.sin_port = htons(strtoul(spec + 4, NULL, 0));
+		addr.in.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+		addrlen = sizeof(addr.in);
+	}
+
+	fd = socket(addr.sa.sa_family,
+		    SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+	if (fd < 0) {
+		DBG("Failed to create socket (%s)", strerror(errno));
+		return false;
+	}
+
+	setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+
+	if (bind(fd, &addr.sa, addrlen) < 0 ||
+	    listen(fd, MAX_CLIENTS) < 0 ||
+	    epoll_ctl(epoll_fd, EPOLL_CTL_ADD, fd, &ev) < 0) {
+		DBG("Failed to listen on %s (%s)", spec, strerror(errno));
+		close(fd);
+		return false;
+	}
+
+	if (addr.sa.sa_family == AF_UNIX)
+		pcap->unix_path = g_strdup(addr.un.sun_path);
+
+	pcap->listen_fd = fd;
+
+	return true;
+}
+
+bool monitor_pcap_flush(void)
+{
+	size_t offset = 0;
+	ssize_t len;
+	int i;
+
+	if (!pcap)
+		return false;
+
+	pcap->flush_at = 0;
+
+	if (!pcap->header_done) {
+		pcap->header = g_realloc(pcap->header,
+					 pcap->header_len + pcap->len);
+		memcpy(pcap->header + pcap->header_len, pcap->buf, pcap->len);
+		pcap->header_len += pcap->len;
+	}
+
+	for (i = 0; i < MAX_CLIENTS; i++)
+		if (pcap->clients[i].fd >= 0)
+			pcap_client_send(i, pcap->buf, pcap->len);
+
+	while (pcap->fd >= 0 && offset < pcap->len) {
+		len = write(pcap->fd, pcap->buf + offset, pcap->len - offset);
+		if (len < 0 && errno == EINTR)
+			continue;
+
+		if (len < 0) {
+			DBG("Failed to write %zu bytes of PCAP data (%s)",
+			    pcap->len - offset, strerror(errno));
+			pcap->len = 0;
+			return false;
+		}
+
+		offset += len;
+	}
+
+	pcap->len = 0;
+
+	return true;
+}
+
+/* Checkpoint: everything captured so far is on the disk afterwards */
+bool monitor_pcap_sync(void)
+{
+	if (!monitor_pcap_flush())
+		return false;
+
+	if (pcap->fd < 0)
+		return true;
+
+	if (fdatasync(pcap->fd) < 0) {
+		DBG("Failed to sync PCAP file (%s)", strerror(errno));
+		return false;
+	}
+
+	return true;
+}
+
+/* Milliseconds until the next flush or checkpoint, -1 if none is due */
+static int monitor_pcap_timeout(void)
+{
+	uint64_t next = 0, now;
+
+	if (!pcap)
+		return -1;
+
+	if (pcap->flush_at)
+		next = pcap->flush_at;
+
+	if (pcap->sync_at && (!next || pcap->sync_at < next))
+		next = pcap->sync_at;
+
+	if (!next)
+		return -1;
+
+	now = now_ms();
+
+	return next > now ? next - now : 0;
+}
+
+static void monitor_pcap_expire(void)
+{
+	uint64_t now = now_ms();
+
+	if (!pcap)
+		return;
+
+	if (pcap->flush_at && now >= pcap->flush_at)
+		monitor_pcap_flush();
+
+	if (pcap->sync_at && now >= pcap->sync_at) {
+		monitor_pcap_sync();
+		pcap->sync_at = now + sync_secs * 1000;
+	}
+}
+
 void monitor_pcap_free(void)
 {
+	int i;
+
 	if (!pcap)
 		return;
 
+	if (sync_secs)
+		monitor_pcap_sync();
+	else
+		monitor_pcap_flush();
+
 	if (pcap->fd >= 0)
 		close(pcap->fd);
 
+	for (i = 0; i < MAX_CLIENTS; i++)
+		if (pcap->clients[i].fd >= 0)
+			pcap_client_close(&pcap->clients[i]);
+
+	if (pcap->listen_fd >= 0)
+		close(pcap->listen_fd);
+
+	if (pcap->unix_path)
+		unlink(pcap->unix_path);
+
+	g_free(pcap->unix_path);
+	g_free(pcap->header);
+	g_free(pcap->buf);
 	g_free(pcap);
+	pcap = NULL;
 }
 
-bool monitor_pcap_create(const char *pathname)
+static void pcap_put(const void *data, size_t len)
 {
-	struct pcap_file_header hdr;
-	ssize_t len;
+	memcpy(pcap->buf + pcap->len, data, len);
+	pcap->len += len;
+}
 
-	pcap = g_new0(struct pcap_fd, 1);
-	pcap->fd = open(pathname, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC,
-					S_IRUSR | S_IWUSR | S_IRGRP | S_IROTH);
-	if (pcap->fd < 0) {
-		DBG("Failed to create PCAP file");
-		g_free(pcap);
-		return false;
+static void pcap_pad(size_t len)
+{
+	static const uint8_t zero[3];
+
+	pcap_put(zero, PCAPNG_PAD(len) - len);
+}
+
+/* pcapng block: type and length, the body, and the length again. The
+ * length is patched in when the block is complete.
+ */
+static size_t pcapng_block_start(uint32_t type)
+{
+	uint32_t hdr[2] = { type, 0 };
+	size_t start = pcap->len;
+
+	pcap_put(hdr, sizeof(hdr));
+
+	return start;
+}
+
+static void pcapng_block_end(size_t start)
+{
+	uint32_t len = pcap->len - start + sizeof(len);
+
+	pcap_put(&len, sizeof(len));
+	memcpy(pcap->buf + start + sizeof(uint32_t), &len, sizeof(len));
+}
+
+static void pcapng_option(uint16_t code, const void *value, uint16_t len)
+{
+	uint16_t hdr[2] = { code, len };
+
+	pcap_put(hdr, sizeof(hdr));
+
+	if (len) {
+		pcap_put(value, len);
+		pcap_pad(len);
+	}
+}
+
+static void pcapng_header(void)
+{
+	static const char appl[] = "monitor_15_4";
+	uint8_t tsresol = 9;	/* nanoseconds */
+	uint32_t bom = PCAPNG_BOM;
+	uint16_t version[2] = { 1, 0 };
+	int64_t section_len = -1;
+	size_t block;
+	int i;
+
+	block = pcapng_block_start(PCAPNG_SHB);
+	pcap_put(&bom, sizeof(bom));
+	pcap_put(version, sizeof(version));
+	pcap_put(&section_len, sizeof(section_len));
+	pcapng_option(PCAPNG_OPT_SHB_USERAPPL, appl, strlen(appl));
+	pcapng_option(PCAPNG_OPT_END, NULL, 0);
+	pcapng_block_end(block);
+
+	/* One interface per node, the interface id is the node index */
+	for (i = 0; i < node_count; i++) {
+		uint16_t linktype[2] = { LINKTYPE_IEEE802_15_4_NOFCS, 0 };
+		uint32_t snaplen = PCAP_SNAPLEN;
+		char *name = nodes[i].pipe_out;
+		size_t len = strlen(name) - strlen(PIPE_OUT);
+
+		if (pcap->len > flush_size)
+			monitor_pcap_flush();
+
+		block = pcapng_block_start(PCAPNG_IDB);
+		pcap_put(linktype, sizeof(linktype));
+		pcap_put(&snaplen, sizeof(snaplen));
+		pcapng_option(PCAPNG_OPT_IF_NAME, name, len);
+		pcapng_option(PCAPNG_OPT_IF_TSRESOL, &tsresol,
+			      sizeof(tsresol));
+		pcapng_option(PCAPNG_OPT_END, NULL, 0);
+		pcapng_block_end(block);
 	}
+}
+
+static void pcap_header(void)
+{
+	struct pcap_file_header hdr;
 
 	memset(&hdr, 0, PCAP_FILE_HDR_SIZE);
 	hdr.magic = 0xa1b2c3d4;
@@ -140,24 +684,92 @@ bool monitor_pcap_create(const char *pathname)
 	hdr.version_minor = 0x0004;
 	hdr.thiszone = 0;
 	hdr.sigfigs = 0;
-	hdr.snaplen = 0x0000ffff;
-	/*
-	 * http://www.tcpdump.org/linktypes.html
-	 * LINKTYPE_IEEE802_15_4_NOFCS : 230
-	 */
-	hdr.linktype = 0x000000E6;
-
-	len = write(pcap->fd, &hdr, PCAP_FILE_HDR_SIZE);
-	if (len < 0) {
-		DBG("Failed to write PCAP header");
-		goto failed;
+	hdr.snaplen = PCAP_SNAPLEN;
+	hdr.linktype = LINKTYPE_IEEE802_15_4_NOFCS;
+
+	pcap_put(&hdr, PCAP_FILE_HDR_SIZE);
+}
+
+/* The output follows the conventions of "wireshark -k -i": "-" is
+ * stdout, a FIFO is opened once the viewer has opened the other end,
+ * and tcp:PORT or unix:PATH accept any number of viewers over time.
+ * Anything else is a capture file.
+ */
+static bool pcap_open(const char *pathname)
+{
+	struct stat st;
+	int fd;
+
+	if (!strncmp(pathname, "tcp:", 4) || !strncmp(pathname, "unix:", 5))
+		return pcap_listen(pathname);
+
+	if (!strcmp(pathname, "-")) {
+		/* Redirected to a file, which cannot block */
+		if (!fstat(STDOUT_FILENO, &st) && S_ISREG(st.st_mode)) {
+			pcap->fd = STDOUT_FILENO;
+			return true;
+		}
+
+		return pcap_client_add(STDOUT_FILENO);
+	}
+
+	if (!stat(pathname, &st) && S_ISFIFO(st.st_mode)) {
+		DBG("Waiting for a reader on %s", pathname);
+
+		fd = open(pathname, O_WRONLY | O_CLOEXEC);
+		if (fd < 0) {
+			DBG("Failed to open fifo %s", pathname);
+			return false;
+		}
+
+		return pcap_client_add(fd);
+	}
+
+	pcap->fd = open(pathname, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC,
+					S_IRUSR | S_IWUSR | S_IRGRP | S_IROTH);
+	if (pcap->fd < 0) {
+		DBG("Failed to create PCAP file");
+		return false;
 	}
 
-	if (len != PCAP_FILE_HDR_SIZE) {
-		DBG("Written PCAP header size mimatch\n");
+	return true;
+}
+
+bool monitor_pcap_create(const char *pathname, bool pcapng)
+{
+	int i;
+
+	pcap = g_new0(struct pcap_fd, 1);
+	pcap->fd = -1;
+	pcap->listen_fd = -1;
+
+	for (i = 0; i < MAX_CLIENTS; i++)
+		pcap->clients[i].fd = -1;
+
+	if (!pcap_open(pathname))
+		goto failed;
+
+	pcap->pcapng = pcapng;
+
+	/* Room for one more record of the maximum snaplen */
+	pcap->size = flush_size + PCAP_RECORD_MAX;
+	pcap->buf = g_malloc(pcap->size);
+
+	if (pcapng)
+		pcapng_header();
+	else
+		pcap_header();
+
+	if (!monitor_pcap_flush()) {
+		DBG("Failed to write PCAP header");
 		goto failed;
 	}
 
+	pcap->header_done = true;
+
+	if (sync_secs && pcap->fd >= 0)
+		pcap->sync_at = now_ms() + sync_secs * 1000;
+
 	return true;
 
 failed:
@@ -166,341 +778,684 @@ failed:
 	return false;
 }
 
-bool monitor_pcap_write(const void *data, uint32_t size)
+/* Stage one frame received from node "iface" at time ts */
+bool monitor_pcap_write(int iface, const struct timespec *ts,
+			const void *data, uint32_t size)
 {
-	struct pcap_frame frame;
-	struct timeval tv;
-	ssize_t len;
-
 	if (!pcap)
 		return false;
 
-	memset(&frame, 0, PCAP_FRAME_SIZE);
+	if (pcap->len + PCAP_RECORD_MAX > pcap->size &&
+	    !monitor_pcap_flush())
+		return false;
+
+	if (pcap->pcapng) {
+		uint64_t ns = (uint64_t)ts->tv_sec * 1000000000ULL +
+			ts->tv_nsec;
+		uint32_t epb[5] = { iface, ns >> 32, ns, size, size };
+		size_t block;
+
+		block = pcapng_block_start(PCAPNG_EPB);
+		pcap_put(epb, sizeof(epb));
+		pcap_put(data, size);
+		pcap_pad(size);
+		pcapng_block_end(block);
+	} else {
+		struct pcap_frame frame;
+
+		frame.ts_sec = ts->tv_sec;
+		frame.ts_usec = ts->tv_nsec / 1000;
+		frame.caplen = size;
+		frame.len = size;
+
+		pcap_put(&frame, PCAP_FRAME_SIZE);
+		pcap_put(data, size);
+	}
+
+	if (pcap->len >= flush_size)
+		return monitor_pcap_flush();
+
+	if (!pcap->flush_at)
+		pcap->flush_at = now_ms() + flush_ms;
+
+	return true;
+}
+
+struct mac_header {
+	uint8_t type;
+	uint16_t dst_pan;
+	uint16_t src_pan;
+	struct mac_addr dst;
+	struct mac_addr src;
+	int payload;		/* offset, -1 if encrypted */
+};
+
+#define MAC_FCF_TYPE(fcf)		((fcf) & 0x7)
+#define MAC_FCF_SECURITY		(1 << 3)
+#define MAC_FCF_PAN_COMP		(1 << 6)
+#define MAC_FCF_DST_MODE(fcf)		(((fcf) >> 10) & 0x3)
+#define MAC_FCF_SRC_MODE(fcf)		(((fcf) >> 14) & 0x3)
+
+static int mac_addr_len(uint8_t mode)
+{
+	return mode == MAC_ADDR_SHORT ? 2 : mode == MAC_ADDR_EXT ? 8 : 0;
+}
 
-	gettimeofday(&tv, NULL);
-	frame.ts_sec = tv.tv_sec;
-	frame.ts_usec = tv.tv_usec;
-	frame.caplen = size;
-	frame.len = size;
+/* Parse the MAC header of a 2003/2006 frame, the 2015 header IEs and
+ * PAN ID compression variants are not handled. A PAN ID that is not in
+ * the frame is 0xffff.
+ */
+static bool mac_parse(const uint8_t *frame, size_t len,
+		      struct mac_header *hdr)
+{
+	uint16_t fcf;
+	size_t offset = 3;	/* frame control and sequence number */
+	int alen;
 
-	len = write(pcap->fd, &frame, PCAP_FRAME_SIZE);
-	if (len < 0 || len != PCAP_FRAME_SIZE) {
-		DBG("Failed to write PCAP frame or size mismatch %d\n", len);
+	if (len < offset)
 		return false;
+
+	fcf = frame[0] | frame[1] << 8;
+
+	hdr->type = MAC_FCF_TYPE(fcf);
+	hdr->dst.mode = MAC_FCF_DST_MODE(fcf);
+	hdr->src.mode = MAC_FCF_SRC_MODE(fcf);
+	hdr->dst_pan = hdr->src_pan = 0xffff;
+
+	alen = mac_addr_len(hdr->dst.mode);
+	if (alen) {
+		if (offset + 2 + alen > len)
+			return false;
+
+		hdr->dst_pan = frame[offset] | frame[offset + 1] << 8;
+		memcpy(hdr->dst.addr, frame + offset + 2, alen);
+		offset += 2 + alen;
 	}
 
-	fsync(pcap->fd);
+	alen = mac_addr_len(hdr->src.mode);
+	if (alen) {
+		if (fcf & MAC_FCF_PAN_COMP) {
+			hdr->src_pan = hdr->dst_pan;
+		} else {
+			if (offset + 2 > len)
+				return false;
 
-	len = write(pcap->fd, data, size);
-	if (len < 0 || len != size) {
-		DBG("Failed to write PCAP data or size mismatch %d\n", len);
-		return false;
+			hdr->src_pan = frame[offset] | frame[offset + 1] << 8;
+			offset += 2;
+		}
+
+		if (offset + alen > len)
+			return false;
+
+		memcpy(hdr->src.addr, frame + offset, alen);
+		offset += alen;
 	}
 
-	fsync(pcap->fd);
+	hdr->payload = (fcf & MAC_FCF_SECURITY) ? -1 : (int)offset;
+
 	return true;
 }
 
-static gboolean fifo_handler1(GIOChannel *channel, GIOCondition cond,
-							gpointer user_data)
+static bool mac_addr_match(const struct mac_addr *want,
+			   const struct mac_addr *addr)
 {
-	static bool starting = true;
-	unsigned char buf[1];
-	ssize_t result;
-	int fd;
+	return want->mode == addr->mode &&
+		!memcmp(want->addr, addr->addr, mac_addr_len(addr->mode));
+}
 
-	if (cond & (G_IO_NVAL | G_IO_ERR | G_IO_HUP)) {
-		DBG("First pipe closed");
-		return FALSE;
+static bool frame_filter_match(const uint8_t *frame, size_t len)
+{
+	struct mac_header hdr;
+
+	if (filter.fields) {
+		if (!mac_parse(frame, len, &hdr))
+			goto drop;
+
+		if ((filter.fields & FILTER_TYPE) && hdr.type != filter.type)
+			goto drop;
+
+		if ((filter.fields & FILTER_PAN) &&
+		    hdr.dst_pan != filter.pan && hdr.src_pan != filter.pan)
+			goto drop;
+
+		if ((filter.fields & FILTER_SRC) &&
+		    !mac_addr_match(&filter.src, &hdr.src))
+			goto drop;
+
+		if ((filter.fields & FILTER_DST) &&
+		    !mac_addr_match(&filter.dst, &hdr.dst))
+			goto drop;
+
+		/* 6LoWPAN dispatch, the first byte of a data frame payload */
+		if ((filter.fields & FILTER_DISPATCH) &&
+		    (hdr.type != 1 || hdr.payload < 0 ||
+		     (size_t)hdr.payload >= len ||
+		     (frame[hdr.payload] & filter.dispatch_mask) !=
+		     filter.dispatch))
+			goto drop;
 	}
 
-	memset(buf, 0, sizeof(buf));
-	fd = g_io_channel_unix_get_fd(channel);
+	if (filter.sample > 1 && filter.matched++ % filter.sample)
+		goto drop;
 
-	result = read(fd, buf, 1);
-	if (result != 1) {
-		DBG("Failed to read %lu", result);
-		return FALSE;
-	}
+	return true;
 
-	if (write(fd2_in, buf, 1) < 0) {
-		DBG("Error, write failed to %s", pipe_2_in);
-		return FALSE;
-	}
-#if EXTRA_DEBUG
-	DBG("[%d/%d] starting %d fifo 1 read from %d and wrote %d bytes to %d",
-	    input1_offset, input1_len, starting, fd, 1, fd2_in);
-#endif
+drop:
+	filter.dropped++;
 
-	if (starting && input1_len == 0 && input1_offset == 0 &&
-	    buf[0] == 0 && input1_type == 0) {
-		/* sync byte */
-		goto done;
-	} else if (starting && input1_len == 0 && input1_offset == 0
-		   && buf[0] != 0) {
-		starting = false;
-	}
+	return false;
+}
 
-#if EXTRA_DEBUG
-	DBG("Pipe 1 byte 0x%x", buf[0]);
-#endif
-	if (input1_len == 0 && input1_offset == 0 &&
-		buf[0] == DUMMY_RADIO_15_4_FRAME_TYPE) {
-		input1_type = buf[0];
-#if EXTRA_DEBUG
-		DBG("Frame starting in pipe 1");
-#endif
-		goto done;
-	}
+static const struct {
+	const char *name;
+	uint8_t value;
+	uint8_t mask;
+} dispatch_names[] = {
+	{ "ipv6",	0x41, 0xff },
+	{ "iphc",	0x60, 0xe0 },
+	{ "mesh",	0x80, 0xc0 },
+	{ "frag1",	0xc0, 0xf8 },
+	{ "fragn",	0xe0, 0xf8 },
+};
 
-	if (input1_len == 0 && input1_offset == 0 &&
-		input1_type == DUMMY_RADIO_15_4_FRAME_TYPE) {
-		input1_len = buf[0];
-#if EXTRA_DEBUG
-		DBG("Expecting pipe 1 buf len %d\n", input1_len);
-#endif
-		goto done;
-	}
+static const char * const type_names[] = {
+	"beacon", "data", "ack", "cmd",
+};
 
-	if (input1_len) {
-		input1[input1_offset++] = buf[0];
+/* 0x1234 is a short address, 00:11:22:33:44:55:66:77 an extended one */
+static bool mac_addr_parse(const char *str, struct mac_addr *mac)
+{
+	uint8_t ext[8];
+	char *end;
+	unsigned long value;
+	int i;
+
+	if (sscanf(str, "%hhx:%hhx:%hhx:%hhx:%hhx:%hhx:%hhx:%hhx",
+		   &ext[0], &ext[1], &ext[2], &ext[3],
+		   &ext[4], &ext[5], &ext[6], &ext[7]) == 8) {
+		mac->mode = MAC_ADDR_EXT;
+		for (i = 0; i < 8; i++)
+			mac->addr[i] = ext[7 - i];
+
+		return true;
 	}
 
-	if (input1_len && input1_len == input1_offset) {
-		DBG("Received %d bytes in pipe 1", input1_len);
+	value = strtoul(str, &end, 16);
+	if (*end || end == str || value > 0xffff)
+		return false;
+
+	mac->mode = MAC_ADDR_SHORT;
+	mac->addr[0] = value;
+	mac->addr[1] = value >> 8;
 
-		monitor_pcap_write(input1, input1_len);
-		input1_len = input1_offset = 0;
-		memset(input1, 0, sizeof(input1));
+	return true;
+}
 
-		fsync(fd2_in);
+/* Comma separated key=value terms, e.g. type=data,pan=0xabcd,sample=10 */
+static bool frame_filter_parse(char *spec)
+{
+	char *term, *value, *end, *saveptr = NULL;
+	unsigned long num;
+	unsigned int i;
+
+	for (term = strtok_r(spec, ",", &saveptr); term;
+	     term = strtok_r(NULL, ",", &saveptr)) {
+		value = strchr(term, '=');
+		if (!value)
+			goto invalid;
+
+		*value++ = '\0';
+
+		if (!strcmp(term, "type")) {
+			for (i = 0; i < G_N_ELEMENTS(type_names); i++)
+				if (!strcmp(value, type_names[i]))
+					break;
+
+			if (i == G_N_ELEMENTS(type_names)) {
+				i = strtoul(value, &end, 0);
+				if (*end || end == value || i > 7)
+					goto invalid;
+			}
+
+			filter.type = i;
+			filter.fields |= FILTER_TYPE;
+		} else if (!strcmp(term, "pan")) {
+			num = strtoul(value, &end, 16);
+			if (*end || end == value || num > 0xffff)
+				goto invalid;
+
+			filter.pan = num;
+			filter.fields |= FILTER_PAN;
+		} else if (!strcmp(term, "src")) {
+			if (!mac_addr_parse(value, &filter.src))
+				goto invalid;
+
+			filter.fields |= FILTER_SRC;
+		} else if (!strcmp(term, "dst")) {
+			if (!mac_addr_parse(value, &filter.dst))
+				goto invalid;
+
+			filter.fields |= FILTER_DST;
+		} else if (!strcmp(term, "dispatch")) {
+			for (i = 0; i < G_N_ELEMENTS(dispatch_names); i++)
+				if (!strcmp(value, dispatch_names[i].name))
+					break;
+
+			if (i < G_N_ELEMENTS(dispatch_names)) {
+				filter.dispatch = dispatch_names[i].value;
+				filter.dispatch_mask = dispatch_names[i].mask;
+			} else {
+				num = strtoul(value, &end, 0);
+				if (*end || end == value || num > 0xff)
+					goto invalid;
+
+				filter.dispatch = num;
+				filter.dispatch_mask = 0xff;
+			}
+
+			filter.fields |= FILTER_DISPATCH;
+		} else if (!strcmp(term, "sample")) {
+			filter.sample = strtoul(value, &end, 0);
+			if (*end || end == value || !filter.sample)
+				goto invalid;
+		} else {
+			goto invalid;
+		}
 	}
 
-done:
-	return TRUE;
+	return true;
+
+invalid:
+	fprintf(stderr, "Invalid filter term %s\n", term);
+
+	return false;
 }
 
-static gboolean fifo_handler2(GIOChannel *channel, GIOCondition cond,
-							gpointer user_data)
+static void node_frame(const uint8_t *frame, size_t len, void *user_data)
 {
-	static bool starting = true;
-	unsigned char buf[1];
-	ssize_t result;
-	int fd;
+	struct monitor_node *node = user_data;
+	struct timespec ts;
 
-	if (cond & (G_IO_NVAL | G_IO_ERR | G_IO_HUP)) {
-		DBG("Second pipe closed");
-		return FALSE;
-	}
+	if (!len)
+		return;
 
-	memset(buf, 0, sizeof(buf));
-	fd = g_io_channel_unix_get_fd(channel);
+	DBG("Received %zu bytes in pipe %d", len, node->id);
 
-	result = read(fd, buf, 1);
-	if (result != 1) {
-		DBG("Failed to read %lu", result);
-		return FALSE;
+	if (frame_filter_match(frame, len)) {
+		clock_gettime(CLOCK_REALTIME, &ts);
+		monitor_pcap_write(node - nodes, &ts, frame, len);
 	}
+}
 
-	if (write(fd1_in, buf, 1) < 0) {
-		DBG("Error, write failed to %s", pipe_1_in);
-		return FALSE;
-	}
-#if EXTRA_DEBUG
-	DBG("[%d/%d] starting %d fifo 2 read from %d and wrote %d bytes to %d",
-	    input2_offset, input2_len, starting, fd, 1, fd1_in);
-#endif
-	if (starting && input2_len == 0 && input2_offset == 0 &&
-	    buf[0] == 0 && input2_type == 0) {
-		/* sync byte */
-		goto done;
-	} else if (starting && input2_len == 0 && input2_offset == 0
-		   && buf[0] != 0) {
-		starting = false;
+static bool write_all(int fd, const uint8_t *buf, size_t len)
+{
+	ssize_t ret;
+
+	while (len) {
+		ret = write(fd, buf, len);
+		if (ret < 0 && errno == EINTR)
+			continue;
+
+		if (ret < 0)
+			return false;
+
+		buf += ret;
+		len -= ret;
 	}
 
-#if EXTRA_DEBUG
-	DBG("Pipe 2 byte 0x%x", buf[0]);
-#endif
-	if (input2_len == 0 && input2_offset == 0 &&
-		buf[0] == DUMMY_RADIO_15_4_FRAME_TYPE) {
-#if EXTRA_DEBUG
-		DBG("Frame starting in pipe 2");
-#endif
-		input2_type = buf[0];
-		goto done;
+	return true;
+}
+
+static void node_broadcast(struct monitor_node *node, const uint8_t *buf,
+			   size_t len)
+{
+	int i;
+
+	for (i = 0; i < node_count; i++) {
+		struct monitor_node *peer = &nodes[i];
+
+		if (peer == node || peer->fd_in < 0)
+			continue;
+
+		if (!write_all(peer->fd_in, buf, len)) {
+			DBG("Error, write failed to %s (%s)", peer->pipe_in,
+			    strerror(errno));
+			close(peer->fd_in);
+			peer->fd_in = -1;
+		}
 	}
+}
+
+static void node_close(struct monitor_node *node)
+{
+	node_broadcast(node, node->pending, node->pending_len);
+	node->pending_len = 0;
+
+	epoll_ctl(epoll_fd, EPOLL_CTL_DEL, node->fd_out, NULL);
+	close(node->fd_out);
+	node->fd_out = -1;
+}
 
-	if (input2_len == 0 && input2_offset == 0 &&
-		input2_type == DUMMY_RADIO_15_4_FRAME_TYPE) {
-		input2_len = buf[0];
+/* Read everything that is available in one go and run the frame parser
+ * over it. The complete frames, together with what was held back from
+ * the previous read, go to all the other nodes with one write each and
+ * the start of an unfinished frame is kept for the next round.
+ */
+static void node_forward(struct monitor_node *node)
+{
+	uint8_t buf[PIPE_PENDING_SIZE + PIPE_READ_SIZE];
+	size_t start = node->pending_len, end;
+	ssize_t result;
+
+	result = read(node->fd_out, buf + start, PIPE_READ_SIZE);
+	if (result < 0 && (errno == EINTR || errno == EAGAIN))
+		return;
+
+	if (result <= 0) {
+		DBG("Pipe %d closed (%zd)", node->id, result);
+		node_close(node);
+		return;
+	}
 #if EXTRA_DEBUG
-		DBG("Expecting pipe 2 buf len %d\n", input2_len);
+	DBG("[%d/%d] fifo %d read %zd bytes from %d", node->parser.offset,
+	    node->parser.len, node->id, result, node->fd_out);
 #endif
-		goto done;
-	}
 
-	if (input2_len) {
-		input2[input2_offset++] = buf[0];
-	}
+	memcpy(buf, node->pending, start);
 
-	if (input2_len && input2_len == input2_offset) {
-		DBG("Received %d bytes in pipe 2", input2_len);
+	/* Anything pending is an unfinished frame, so no boundary at 0 */
+	end = frame_parser_feed(&node->parser, buf + start, result,
+				node_frame, node);
+	if (end)
+		end += start;
 
-		monitor_pcap_write(input2, input2_len);
-		input2_len = input2_offset = 0;
-		memset(input2, 0, sizeof(input2));
+	/* Do not hold back more than a frame, whatever the data is */
+	if (start + result - end > PIPE_PENDING_SIZE)
+		end = start + result;
 
-		fsync(fd1_in);
-	}
+	node_broadcast(node, buf, end);
 
-done:
-	return TRUE;
+	node->pending_len = start + result - end;
+	memcpy(node->pending, buf + end, node->pending_len);
 }
 
-static int setup_fifofd1(void)
+static int setup_fifofd(struct monitor_node *node, int index)
 {
-	GIOChannel *channel;
-	guint source;
-	int fd;
+	struct epoll_event ev = { .events = EPOLLIN, .data.u32 = index };
 
-	fd = open(pipe_1_out, O_RDONLY);
-	if (fd < 0) {
-		DBG("Failed to open fifo %s", pipe_1_out);
-		return fd;
+	node->fd_out = open(node->pipe_out, O_RDONLY | O_CLOEXEC);
+	if (node->fd_out < 0) {
+		DBG("Failed to open fifo %s", node->pipe_out);
+		return -errno;
 	}
 
-	DBG("Pipe 1 OUT fd %d", fd);
+	DBG("Pipe %d OUT fd %d", node->id, node->fd_out);
+
+	if (epoll_ctl(epoll_fd, EPOLL_CTL_ADD, node->fd_out, &ev) < 0) {
+		DBG("Failed to watch fifo %s", node->pipe_out);
+		return -errno;
+	}
 
-	channel = g_io_channel_unix_new(fd);
+	return 0;
+}
 
-	g_io_channel_set_close_on_unref(channel, TRUE);
+static void signal_handler(int fd)
+{
+	struct signalfd_siginfo si;
 
-	source = g_io_add_watch(channel,
-				G_IO_IN | G_IO_HUP | G_IO_ERR | G_IO_NVAL,
-				fifo_handler1, NULL);
+	if (read(fd, &si, sizeof(si)) != sizeof(si))
+		return;
 
-	g_io_channel_unref(channel);
+	DBG("Terminating on signal %d", si.ssi_signo);
 
-	return source;
+	/* The capture is flushed on the way out of main() */
+	running = false;
 }
 
-static int setup_fifofd2(void)
+static int setup_signalfd(void)
 {
-	GIOChannel *channel;
-	guint source;
+	struct epoll_event ev = { .events = EPOLLIN,
+				  .data.u32 = SIGNAL_EVENT };
+	sigset_t mask;
 	int fd;
 
-	fd = open(pipe_2_out, O_RDONLY);
-	if (fd < 0) {
-		DBG("Failed to open fifo %s", pipe_2_out);
-		return fd;
-	}
+	sigemptyset(&mask);
+	sigaddset(&mask, SIGINT);
+	sigaddset(&mask, SIGTERM);
 
-	DBG("Pipe 2 OUT fd %d", fd);
+	if (sigprocmask(SIG_BLOCK, &mask, NULL) < 0) {
+		DBG("Failed to set signal mask");
+		return -errno;
+	}
 
-	channel = g_io_channel_unix_new(fd);
+	fd = signalfd(-1, &mask, SFD_CLOEXEC);
+	if (fd < 0) {
+		DBG("Failed to create signal descriptor");
+		return -errno;
+	}
 
-	g_io_channel_set_close_on_unref(channel, TRUE);
+	if (epoll_ctl(epoll_fd, EPOLL_CTL_ADD, fd, &ev) < 0) {
+		DBG("Failed to watch signal descriptor");
+		close(fd);
+		return -errno;
+	}
 
-	source = g_io_add_watch(channel,
-				G_IO_IN | G_IO_HUP | G_IO_ERR | G_IO_NVAL,
-				fifo_handler2, NULL);
+	return fd;
+}
 
-	g_io_channel_unref(channel);
+static void main_loop(int signal_fd)
+{
+	struct epoll_event events[MAX_EVENTS];
+	int i, n;
+
+	running = true;
+
+	while (running) {
+		n = epoll_wait(epoll_fd, events, MAX_EVENTS,
+			       monitor_pcap_timeout());
+		if (n < 0 && errno != EINTR) {
+			DBG("epoll_wait failed (%s)", strerror(errno));
+			break;
+		}
+
+		for (i = 0; i < n; i++) {
+			uint32_t tag = events[i].data.u32;
+
+			if (tag == SIGNAL_EVENT)
+				signal_handler(signal_fd);
+			else if (tag == LISTEN_EVENT)
+				pcap_accept();
+			else if (tag & CLIENT_EVENT)
+				pcap_client_event(tag & ~CLIENT_EVENT,
+						  events[i].events);
+			else
+				node_forward(&nodes[tag]);
+		}
+
+		monitor_pcap_expire();
+	}
+}
 
-	return source;
+static void usage(const char *name)
+{
+	printf("Usage: %s [-n] [-b bytes] [-t ms] [-f filter] [-S secs] [-v] "
+	       "<pcapfile> [<pipe_1> <pipe_2> ... <pipe_N>]\n", name);
+	printf("   e.g.: monitor_15_4 sample.pcap [/tmp/ip-15-4-1 /tmp/ip-15-4-2]\n");
+	printf("   Every node gets what the others write to their "
+	       "<pipe>.out in its <pipe>.in\n");
+	printf("   <pcapfile> can also stream to a live viewer, which "
+	       "misses frames\n"
+	       "   rather than slowing the nodes down when it falls behind:\n"
+	       "      -          stdout, e.g. | wireshark -k -i -\n"
+	       "      <fifo>     an existing FIFO, e.g. wireshark -k -i <fifo>\n"
+	       "      tcp:PORT   localhost, e.g. wireshark -k -i TCP@127.0.0.1:PORT\n"
+	       "      unix:PATH  a UNIX stream socket\n");
+	printf("   -n Write pcapng with one interface per node and "
+	       "nanosecond timestamps,\n"
+	       "      the default if <pcapfile> ends in .pcapng\n");
+	printf("   -b Write the capture once this many bytes are "
+	       "buffered (default %d)\n", PCAP_FLUSH_SIZE);
+	printf("   -t Write the capture at least every this many ms "
+	       "(default %d)\n", PCAP_FLUSH_MS);
+	printf("   -f Capture only the frames matching all of the comma "
+	       "separated terms\n"
+	       "      type=beacon|data|ack|cmd, pan=PANID, "
+	       "src=ADDR, dst=ADDR,\n"
+	       "      dispatch=ipv6|iphc|mesh|frag1|fragn|BYTE and "
+	       "sample=N for 1 in N,\n"
+	       "      ADDR is 0x1234 or 00:11:22:33:44:55:66:77, "
+	       "e.g. -f type=data,dst=0xffff\n");
+	printf("   -S Sync the capture to disk every this many seconds "
+	       "and at exit\n");
+	printf("   -v Log to stderr too\n");
 }
 
 int main(int argc, char *argv[])
 {
-	int fifo1 = -1, fifo2 = -1, ret;
-	char *pipe1 = "/tmp/ip-15-4-1";
-	char *pipe2 = "/tmp/ip-15-4-2";
+	int ret, c, i, signal_fd = -1;
+	const char *name = argv[0];
+	char *default_pipes[] = { "/tmp/ip-15-4-1", "/tmp/ip-15-4-2" };
+	char **pipes = default_pipes;
+	gboolean verbose = FALSE;
+	bool pcapng = false;
+	size_t len;
+
+	while ((c = getopt(argc, argv, "nb:t:f:S:vh")) != -1) {
+		switch (c) {
+		case 'n':
+			pcapng = true;
+			break;
+		case 'b':
+			flush_size = strtoul(optarg, NULL, 0);
+			break;
+		case 't':
+			flush_ms = strtoul(optarg, NULL, 0);
+			break;
+		case 'f':
+			if (!frame_filter_parse(optarg)) {
+				usage(name);
+				exit(-EINVAL);
+			}
+			break;
+		case 'S':
+			sync_secs = strtoul(optarg, NULL, 0);
+			break;
+		case 'v':
+			verbose = TRUE;
+			break;
+		default:
+			usage(name);
+			exit(-EINVAL);
+		}
+	}
 
-	if (argc < 2) {
-		printf("Usage: %s <pcapfile> [<pipe_1> <pipe_2>]\n", argv[0]);
-		printf("   e.g.: monitor_15_4 sample.pcap [/tmp/ip-15-4-1 /tmp/ip-15-4-2]\n");
+	if (optind >= argc || !flush_ms) {
+		usage(name);
 		exit(-EINVAL);
 	}
 
-	if (argc == 3)
-		pipe1 = argv[2];
+	path = g_strdup(argv[optind++]);
+
+	len = strlen(path);
+	if (len > 7 && !strcmp(path + len - 7, ".pcapng"))
+		pcapng = true;
 
-	if (argc == 4) {
-		pipe1 = argv[2];
-		pipe2 = argv[3];
+	/* A single pipe is paired with the second default one */
+	node_count = 2;
+	if (argc - optind == 1) {
+		default_pipes[0] = argv[optind];
+	} else if (argc - optind > 1) {
+		pipes = &argv[optind];
+		node_count = argc - optind;
 	}
 
-	main_loop = g_main_loop_new(NULL, FALSE);
+	nodes = g_new0(struct monitor_node, node_count);
 
-	pipe_1_in = g_strconcat(pipe1, PIPE_IN, NULL);
-	pipe_1_out = g_strconcat(pipe1, PIPE_OUT, NULL);
-	pipe_2_in = g_strconcat(pipe2, PIPE_IN, NULL);
-	pipe_2_out = g_strconcat(pipe2, PIPE_OUT, NULL);
-	path = g_strdup(argv[1]);
+	for (i = 0; i < node_count; i++) {
+		struct monitor_node *node = &nodes[i];
 
-	log_init("log", FALSE, argc > 4 ? TRUE : FALSE);
+		node->id = i + 1;
+		node->pipe_in = g_strconcat(pipes[i], PIPE_IN, NULL);
+		node->pipe_out = g_strconcat(pipes[i], PIPE_OUT, NULL);
+		node->fd_in = -1;
+		node->fd_out = -1;
+		frame_parser_init(&node->parser);
+	}
 
-	DBG("Pipe 1 IN %s OUT %s", pipe_1_in, pipe_1_out);
-	DBG("Pipe 2 IN %s OUT %s", pipe_2_in, pipe_2_out);
+	log_init("log", FALSE, verbose);
 
-	if (!monitor_pcap_create(path)) {
-		g_free(path);
-		exit(-EINVAL);
-	}
+	for (i = 0; i < node_count; i++)
+		DBG("Pipe %d IN %s OUT %s", nodes[i].id, nodes[i].pipe_in,
+		    nodes[i].pipe_out);
 
-	fifo1 = setup_fifofd1();
-	if (fifo1 < 0) {
-		ret = -EINVAL;
+	/* A node that goes away must not take the others down with it */
+	signal(SIGPIPE, SIG_IGN);
+
+	epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+	if (epoll_fd < 0) {
+		DBG("Failed to create epoll descriptor");
+		ret = -errno;
 		goto exit;
 	}
 
-	fifo2 = setup_fifofd2();
-	if (fifo2 < 0) {
+	if (!monitor_pcap_create(path, pcapng)) {
 		ret = -EINVAL;
 		goto exit;
 	}
 
-	fd1_in = open(pipe_1_in, O_WRONLY);
-	if (fd1_in < 0) {
-		DBG("Failed to open fifo %s", pipe_1_in);
-		ret = -EINVAL;
-		goto exit;
+	for (i = 0; i < node_count; i++) {
+		if (setup_fifofd(&nodes[i], i) < 0) {
+			ret = -EINVAL;
+			goto exit;
+		}
 	}
 
-	fd2_in = open(pipe_2_in, O_WRONLY);
-	if (fd2_in < 0) {
-		DBG("Failed to open fifo %s", pipe_2_in);
-		ret = -EINVAL;
-		goto exit;
+	for (i = 0; i < node_count; i++) {
+		nodes[i].fd_in = open(nodes[i].pipe_in, O_WRONLY | O_CLOEXEC);
+		if (nodes[i].fd_in < 0) {
+			DBG("Failed to open fifo %s", nodes[i].pipe_in);
+			ret = -EINVAL;
+			goto exit;
+		}
+
+		DBG("Pipe %d IN fd %d", nodes[i].id, nodes[i].fd_in);
 	}
 
-	DBG("Pipe 1 IN %d, pipe 2 IN %d", fd1_in, fd2_in);
+	signal_fd = setup_signalfd();
 
-	g_main_loop_run(main_loop);
+	main_loop(signal_fd);
 	ret = 0;
 exit:
-	if (fifo1 >= 0)
-		g_source_remove(fifo1);
+	if (signal_fd >= 0)
+		close(signal_fd);
 
-	if (fifo2 >= 0)
-		g_source_remove(fifo2);
+	for (i = 0; i < node_count; i++) {
+		struct frame_stats *stats = &nodes[i].parser.stats;
 
-	if (fd1_in >= 0)
-		close(fd1_in);
+		DBG("Pipe %d: %llu frames, %llu sync and %llu garbage bytes, "
+		    "%llu resyncs", nodes[i].id, stats->frames, stats->sync,
+		    stats->garbage, stats->resyncs);
 
-	if (fd2_in >= 0)
-		close(fd2_in);
+		if (nodes[i].fd_out >= 0)
+			close(nodes[i].fd_out);
 
+		if (nodes[i].fd_in >= 0)
+			close(nodes[i].fd_in);
+
+		g_free(nodes[i].pipe_in);
+		g_free(nodes[i].pipe_out);
+	}
+
+	if (filter.fields || filter.sample > 1)
+		DBG("%llu frames filtered out", filter.dropped);
+
+	g_free(nodes);
 	g_free(path);
-	g_free(pipe_1_in);
-	g_free(pipe_1_out);
-	g_free(pipe_2_in);
-	g_free(pipe_2_out);
 	monitor_pcap_free();
 	log_cleanup();
-	g_main_loop_unref(main_loop);
+
+	if (epoll_fd >= 0)
+		close(epoll_fd);
 
 	exit(ret);
 }
@@ -0,0 +1,192 @@
+/*
+ * Copyright (c) 2015 Intel Corporation.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <errno.h>
+#include <string.h>
+#include <strings.h>
+
+#include "results.h"
+
+#define MIN(a,b) (((a) < (b)) ? (a) : (b))
+
+static const struct {
+	const char *name;
+	double p;
+} percentiles[] = {
+	{ "p50", 50 },
+	{ "p90", 90 },
+	{ "p99", 99 },
+	{ "p99.9", 99.9 },
+};
+
+static int lat_bucket(uint64_t v)
+{
+	int msb;
+
+	if (v < (1 << LAT_SUB_BITS))
+		return v;
+
+	msb = 63 - __builtin_clzll(v);
+
+	return ((msb - LAT_SUB_BITS + 1) << LAT_SUB_BITS) +
+		((v >> (msb - LAT_SUB_BITS)) & ((1 << LAT_SUB_BITS) - 1));
+}
+
+/* Smallest value that falls into bucket b */
+static uint64_t lat_bucket_start(int b)
+{
+	int msb;
+
+	if (b < (1 << LAT_SUB_BITS))
+		return b;
+
+	msb = (b >> LAT_SUB_BITS) - 1 + LAT_SUB_BITS;
+
+	return (uint64_t)((1 << LAT_SUB_BITS) |
+			  (b & ((1 << LAT_SUB_BITS) - 1))) <<
+		(msb - LAT_SUB_BITS);
+}
+
+void lat_add(struct latency *lat, uint64_t rtt)
+{
+	if (!lat->count || rtt < lat->min)
+		lat->min = rtt;
+	if (rtt > lat->max)
+		lat->max = rtt;
+
+	lat->sum += rtt;
+	lat->count++;
+	lat->hist[lat_bucket(rtt)]++;
+}
+
+void lat_merge(struct latency *sum, const struct latency *lat)
+{
+	int b;
+
+	if (lat->count && (!sum->count || lat->min < sum->min))
+		sum->min = lat->min;
+	if (lat->max > sum->max)
+		sum->max = lat->max;
+
+	sum->sum += lat->sum;
+	sum->count += lat->count;
+
+	for (b = 0; b < LAT_BUCKETS; b++)
+		sum->hist[b] += lat->hist[b];
+}
+
+/* Upper end of the bucket holding the p percentile, capped to the
+ * largest value seen.
+ */
+uint64_t lat_percentile(const struct latency *lat, double p)
+{
+	unsigned long long count = 0, rank = lat->count * p / 100;
+	int b;
+
+	if (!lat->count)
+		return 0;
+
+	for (b = 0; b < LAT_BUCKETS - 1; b++) {
+		count += lat->hist[b];
+		if (count > rank)
+			break;
+	}
+
+	return MIN(lat_bucket_start(b + 1) - 1, lat->max);
+}
+
+void results_json_latency(FILE *fp, const struct latency *lat, double unit)
+{
+	size_t i;
+
+	fprintf(fp, "  \"latency_us\": {\"count\": %llu", lat->count);
+	if (lat->count) {
+		fprintf(fp, ", \"min\": %.1f, \"avg\": %.1f, \"max\": %.1f",
+			lat->min / unit, (double)lat->sum / lat->count / unit,
+			lat->max / unit);
+
+		for (i = 0; i < sizeof(percentiles) / sizeof(percentiles[0]);
+		     i++)
+			fprintf(fp, ", \"%s\": %.1f", percentiles[i].name,
+				lat_percentile(lat, percentiles[i].p) / unit);
+	}
+	fprintf(fp, "},\n");
+}
+
+void results_csv_latency(FILE *fp, const struct latency *lat, double unit)
+{
+	size_t i;
+
+	fprintf(fp, "latency_us,count,,%llu\n", lat->count);
+	if (!lat->count)
+		return;
+
+	fprintf(fp, "latency_us,min,,%.1f\n", lat->min / unit);
+	fprintf(fp, "latency_us,avg,,%.1f\n",
+		(double)lat->sum / lat->count / unit);
+	fprintf(fp, "latency_us,max,,%.1f\n", lat->max / unit);
+
+	for (i = 0; i < sizeof(percentiles) / sizeof(percentiles[0]); i++)
+		fprintf(fp, "latency_us,%s,,%.1f\n", percentiles[i].name,
+			lat_percentile(lat, percentiles[i].p) / unit);
+}
+
+void results_json_string(FILE *fp, const char *s)
+{
+	fputc('"', fp);
+
+	for (; s && *s; s++) {
+		unsigned char c = *s;
+
+		if (c == '"' || c == '\\')
+			fprintf(fp, "\\%c", c);
+		else if (c == '\n')
+			fputs("\\n", fp);
+		else if (c == '\t')
+			fputs("\\t", fp);
+		else if (c < 0x20)
+			fprintf(fp, "\\u%04x", c);
+		else
+			fputc(c, fp);
+	}
+
+	fputc('"', fp);
+}
+
+int results_write(const char *path, void (*json)(FILE *fp),
+		  void (*csv)(FILE *fp))
+{
+	size_t len = strlen(path);
+	FILE *fp;
+
+	fp = fopen(path, "w");
+	if (!fp) {
+		perror(path);
+		return -errno;
+	}
+
+	if (len > 4 && !strcasecmp(path + len - 4, ".csv"))
+		csv(fp);
+	else
+		json(fp);
+
+	if (fclose(fp)) {
+		perror(path);
+		return -errno;
+	}
+
+	return 0;
+}
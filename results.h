@@ -0,0 +1,55 @@
+/*
+ * Copyright (c) 2015 Intel Corporation.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef RESULTS_H
+#define RESULTS_H
+
+#include <stdint.h>
+#include <stdio.h>
+
+/* Round trip times go to a log-linear histogram with 2^LAT_SUB_BITS
+ * buckets per power of two, i.e. percentiles are within 12.5%.
+ */
+#define LAT_SUB_BITS 3
+#define LAT_BUCKETS  (64 << LAT_SUB_BITS)
+
+/* Round trip times, in the unit the tool measures them in */
+struct latency {
+	unsigned long long count;
+	uint64_t sum;
+	uint64_t min;
+	uint64_t max;
+	uint64_t hist[LAT_BUCKETS];
+};
+
+void lat_add(struct latency *lat, uint64_t rtt);
+void lat_merge(struct latency *sum, const struct latency *lat);
+uint64_t lat_percentile(const struct latency *lat, double p);
+
+/* The "latency_us" object or rows of the results file, unit being the
+ * number of measured units in a microsecond.
+ */
+void results_json_latency(FILE *fp, const struct latency *lat, double unit);
+void results_csv_latency(FILE *fp, const struct latency *lat, double unit);
+
+/* s as a quoted and escaped JSON string */
+void results_json_string(FILE *fp, const char *s);
+
+/* The format follows the file name, *.csv is CSV and anything else JSON */
+int results_write(const char *path, void (*json)(FILE *fp),
+		  void (*csv)(FILE *fp));
+
+#endif /* RESULTS_H */
@@ -14,20 +14,36 @@
  * limitations under the License.
  */
 
+#define _GNU_SOURCE
+
 #include <stdio.h>
+#include <stdint.h>
+#include <limits.h>
 #include <sys/socket.h>
 #include <netinet/in.h>
+#include <netinet/udp.h>
 #include <poll.h>
 #include <errno.h>
 #include <arpa/inet.h>
 #include <stdlib.h>
 #include <string.h>
 #include <stdbool.h>
+#include <stdatomic.h>
 #include <net/if.h>
 #include <linux/sockios.h>
 #include <ifaddrs.h>
 #include <sys/ioctl.h>
 #include <unistd.h>
+#include <signal.h>
+#include <time.h>
+#include <sys/prctl.h>
+#include <pthread.h>
+#include <sched.h>
+#include <fcntl.h>
+#include <linux/tcp.h>
+#include <linux/errqueue.h>
+
+#include "results.h"
 
 #define SERVER_PORT  42042
 #define CLIENT_PORT  0
@@ -39,6 +55,33 @@
 #define ENTRY_FAIL(e) ENTRY(e, false)
 
 #define TYPE_SEQ_NUM 42
+#define SEQ_HDR_LEN  6		/* struct header + 32 bit sequence number */
+
+#define BATCH_SIZE   64		/* datagrams per sendmmsg()/recvmmsg() */
+#define GSO_BATCH    8		/* GSO super packets per sendmmsg() */
+#define GSO_MAX_SEGS 64
+#define GSO_MAX_SIZE 65000
+
+#define LAT_RING     16384	/* send timestamps kept for latency */
+#define MAX_THREADS  64
+
+#ifndef UDP_SEGMENT
+#define UDP_SEGMENT  103
+#endif
+
+#ifndef SO_ZEROCOPY
+#define SO_ZEROCOPY  60
+#endif
+
+#define TCP_WRITE_SIZE 65536	/* default write size in the TCP mode */
+
+#define NSEC_PER_SEC 1000000000ULL
+
+#define DEFAULT_TRIAL_TIME  10	/* seconds per rate step */
+#define REPLY_GRACE_MS      1000	/* wait for late replies after a step */
+#define MAX_SEND_LAG_NS     (10 * 1000000ULL)
+#define MAX_RATE_STEPS      20
+#define RATE_RESOLUTION     0.01	/* stop searching at 1% of max rate */
 
 struct header {
 	unsigned char type;
@@ -327,11 +370,1342 @@ static int get_address(const char *if_name, int family, void *address)
 	return err;
 }
 
+/* Create another UDP socket like the main one, on its own source port */
+static int client_socket(int family, const char *interface,
+			 const struct sockaddr *addr_recv, int addr_len)
+{
+	int fd;
+
+	fd = socket(family, SOCK_DGRAM, IPPROTO_UDP);
+	if (fd < 0)
+		return -errno;
+
+	if (interface) {
+		struct ifreq ifr;
+
+		memset(&ifr, 0, sizeof(ifr));
+		snprintf(ifr.ifr_name, sizeof(ifr.ifr_name), "%s", interface);
+
+		if (setsockopt(fd, SOL_SOCKET, SO_BINDTODEVICE,
+			       (void *)&ifr, sizeof(ifr)) < 0)
+			goto fail;
+	}
+
+	if (bind(fd, addr_recv, addr_len) < 0)
+		goto fail;
+
+	return fd;
+
+fail:
+	close(fd);
+
+	return -errno;
+}
+
 extern int optind, opterr, optopt;
 extern char *optarg;
 
 #define min(a,b) (((a) < (b)) ? (a) : (b))
 
+static atomic_bool do_exit;
+
+static void signal_handler(int sig)
+{
+	do_exit = true;
+}
+
+/* Per second counters of a run, kept in memory for the results file */
+struct interval {
+	unsigned long long sent;
+	unsigned long long received;
+};
+
+struct timeline {
+	struct interval *iv;
+	size_t count;
+	size_t alloc;
+};
+
+static uint64_t start_ns;	/* second 0 of the timeline */
+
+struct client {
+	int fd;
+	const struct sockaddr *addr_send;
+	int addr_len;
+	int data_size;
+	unsigned pkt_seq;
+	int idx;		/* next data[] entry to send */
+	bool quiet;		/* no progress output, used by the threads */
+
+	/* Batched transmit, the sequence header of every datagram lives
+	 * in hdrs[] and the rest is sent directly from data[].
+	 */
+	unsigned char hdrs[BATCH_SIZE][SEQ_HDR_LEN];
+	struct iovec iovs[BATCH_SIZE][2];
+	struct mmsghdr msgs[BATCH_SIZE];
+
+	/* Batched receive of the replies */
+	unsigned char bufs[BATCH_SIZE][MAX_BUF_SIZE];
+	struct iovec riovs[BATCH_SIZE];
+	struct mmsghdr rmsgs[BATCH_SIZE];
+
+	/* UDP GSO, each message carries gso_segs datagrams of gso_size */
+	bool gso;
+	int gso_size;
+	int gso_segs;
+	unsigned char *gso_bufs[GSO_BATCH];
+	struct iovec gso_iovs[GSO_BATCH];
+	struct mmsghdr gso_msgs[GSO_BATCH];
+	char gso_cmsg[GSO_BATCH][CMSG_SPACE(sizeof(uint16_t))];
+
+	/* Send time of the last LAT_RING sequence numbers */
+	uint64_t sent_ns[LAT_RING];
+
+	struct timeline tl;
+};
+
+/* Result of sending at one rate */
+struct trial {
+	double rate;		/* offered packets per second */
+	unsigned long long sent;
+	unsigned long long received;
+	struct latency lat;	/* round trip times in ns */
+};
+
+static inline uint64_t now_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+
+	return (uint64_t)ts.tv_sec * NSEC_PER_SEC + ts.tv_nsec;
+}
+
+static struct interval *timeline_get(struct timeline *tl, uint64_t now)
+{
+	size_t sec = now > start_ns ? (now - start_ns) / NSEC_PER_SEC : 0;
+
+	if (sec >= tl->alloc) {
+		size_t alloc = tl->alloc ? tl->alloc : 64;
+		struct interval *iv;
+
+		while (alloc <= sec)
+			alloc *= 2;
+
+		iv = realloc(tl->iv, alloc * sizeof(*iv));
+		if (!iv)
+			return NULL;
+
+		memset(iv + tl->alloc, 0, (alloc - tl->alloc) * sizeof(*iv));
+		tl->iv = iv;
+		tl->alloc = alloc;
+	}
+
+	if (sec >= tl->count)
+		tl->count = sec + 1;
+
+	return &tl->iv[sec];
+}
+
+static void timeline_add(struct timeline *tl, uint64_t now,
+			 int sent, int received)
+{
+	struct interval *iv = timeline_get(tl, now);
+
+	if (!iv)
+		return;
+
+	iv->sent += sent;
+	iv->received += received;
+}
+
+static void timeline_merge(struct timeline *sum, const struct timeline *tl)
+{
+	size_t i;
+
+	if (!tl->count || !timeline_get(sum, start_ns +
+					(tl->count - 1) * NSEC_PER_SEC))
+		return;
+
+	for (i = 0; i < tl->count; i++) {
+		sum->iv[i].sent += tl->iv[i].sent;
+		sum->iv[i].received += tl->iv[i].received;
+	}
+}
+
+static int data_count;
+
+static inline int entry_len(const struct client *cl, int idx)
+{
+	if (cl->data_size)
+		return min(data[idx].len, cl->data_size);
+
+	return data[idx].len;
+}
+
+static inline void set_seq_hdr(unsigned char *hdr, unsigned pkt_seq)
+{
+	unsigned seq = htonl(pkt_seq);
+
+	hdr[0] = TYPE_SEQ_NUM;
+	hdr[1] = sizeof(seq);
+	memcpy(&hdr[2], &seq, sizeof(seq));
+}
+
+static void client_init(struct client *cl, int fd,
+			const struct sockaddr *addr_send, int addr_len,
+			int data_size)
+{
+	int i;
+
+	if (!data_count)
+		while (data[data_count].buf)
+			data_count++;
+
+	cl->fd = fd;
+	cl->addr_send = addr_send;
+	cl->addr_len = addr_len;
+	cl->data_size = data_size;
+
+	for (i = 0; i < BATCH_SIZE; i++) {
+		cl->msgs[i].msg_hdr.msg_name = (void *)addr_send;
+		cl->msgs[i].msg_hdr.msg_namelen = addr_len;
+		cl->msgs[i].msg_hdr.msg_iov = cl->iovs[i];
+
+		cl->riovs[i].iov_base = cl->bufs[i];
+		cl->riovs[i].iov_len = MAX_BUF_SIZE;
+		cl->rmsgs[i].msg_hdr.msg_iov = &cl->riovs[i];
+		cl->rmsgs[i].msg_hdr.msg_iovlen = 1;
+	}
+}
+
+/* Remember when the next n sequence numbers were sent */
+static uint64_t record_send_time(struct client *cl, int n)
+{
+	uint64_t now = now_ns();
+	int i;
+
+	for (i = 0; i < n; i++)
+		cl->sent_ns[(cl->pkt_seq + i) % LAT_RING] = now;
+
+	return now;
+}
+
+/* Send the next n (at most BATCH_SIZE) datagrams with one sendmmsg().
+ * Returns the number of datagrams sent.
+ */
+static int send_batch(struct client *cl, int n)
+{
+	int i, idx = cl->idx, ret;
+	uint64_t now;
+
+	for (i = 0; i < n; i++) {
+		struct iovec *iov = cl->iovs[i];
+		int len = entry_len(cl, idx);
+
+		set_seq_hdr(cl->hdrs[i], cl->pkt_seq + i);
+
+		iov[0].iov_base = cl->hdrs[i];
+		iov[0].iov_len = min(len, SEQ_HDR_LEN);
+		iov[1].iov_base = (void *)(data[idx].buf + SEQ_HDR_LEN);
+		iov[1].iov_len = len - iov[0].iov_len;
+
+		cl->msgs[i].msg_hdr.msg_iovlen = iov[1].iov_len ? 2 : 1;
+
+		idx = (idx + 1) % data_count;
+	}
+
+	now = record_send_time(cl, n);
+
+	ret = sendmmsg(cl->fd, cl->msgs, n, 0);
+	if (ret <= 0)
+		return ret;
+
+	cl->pkt_seq += ret;
+	cl->idx = (cl->idx + ret) % data_count;
+
+	timeline_add(&cl->tl, now, ret, 0);
+
+	return ret;
+}
+
+/* Prepare GSO_BATCH buffers of back to back datagrams. Only the
+ * sequence headers have to be written before each send.
+ */
+static int gso_init(struct client *cl)
+{
+	int i, j, len = entry_len(cl, 0);
+
+	if (len < SEQ_HDR_LEN) {
+		fprintf(stderr, "UDP GSO needs datagrams of at least %d "
+			"bytes\n", SEQ_HDR_LEN);
+		return -EINVAL;
+	}
+
+	for (i = 1; i < data_count; i++) {
+		if (entry_len(cl, i) != len) {
+			fprintf(stderr, "UDP GSO needs equally sized "
+				"datagrams\n");
+			return -EINVAL;
+		}
+	}
+
+	cl->gso_size = len;
+	cl->gso_segs = min(GSO_MAX_SEGS, GSO_MAX_SIZE / len);
+
+	for (i = 0; i < GSO_BATCH; i++) {
+		struct msghdr *msg = &cl->gso_msgs[i].msg_hdr;
+		struct cmsghdr *cmsg;
+
+		cl->gso_bufs[i] = malloc(cl->gso_segs * len);
+		if (!cl->gso_bufs[i])
+			return -ENOMEM;
+
+		for (j = 0; j < cl->gso_segs; j++)
+			memcpy(cl->gso_bufs[i] + j * len,
+			       data[j % data_count].buf, len);
+
+		cl->gso_iovs[i].iov_base = cl->gso_bufs[i];
+		cl->gso_iovs[i].iov_len = cl->gso_segs * len;
+
+		msg->msg_name = (void *)cl->addr_send;
+		msg->msg_namelen = cl->addr_len;
+		msg->msg_iov = &cl->gso_iovs[i];
+		msg->msg_iovlen = 1;
+		msg->msg_control = cl->gso_cmsg[i];
+		msg->msg_controllen = sizeof(cl->gso_cmsg[i]);
+
+		cmsg = CMSG_FIRSTHDR(msg);
+		cmsg->cmsg_level = SOL_UDP;
+		cmsg->cmsg_type = UDP_SEGMENT;
+		cmsg->cmsg_len = CMSG_LEN(sizeof(uint16_t));
+		*(uint16_t *)CMSG_DATA(cmsg) = len;
+	}
+
+	cl->gso = true;
+
+	return 0;
+}
+
+/* Send GSO_BATCH super packets, returns the number of datagrams sent */
+static int send_batch_gso(struct client *cl)
+{
+	int i, j, ret;
+	uint64_t now;
+
+	for (i = 0; i < GSO_BATCH; i++)
+		for (j = 0; j < cl->gso_segs; j++)
+			set_seq_hdr(cl->gso_bufs[i] + j * cl->gso_size,
+				    cl->pkt_seq + i * cl->gso_segs + j);
+
+	now = record_send_time(cl, GSO_BATCH * cl->gso_segs);
+
+	ret = sendmmsg(cl->fd, cl->gso_msgs, GSO_BATCH, 0);
+	if (ret <= 0)
+		return ret;
+
+	cl->pkt_seq += ret * cl->gso_segs;
+
+	timeline_add(&cl->tl, now, ret * cl->gso_segs, 0);
+
+	return ret * cl->gso_segs;
+}
+
+/* Read all pending replies, counting the ones sent since first_seq and
+ * their round trip time.
+ */
+static void drain_replies(struct client *cl, unsigned first_seq,
+			  struct trial *t)
+{
+	unsigned seq;
+	uint64_t now;
+	int i, ret, count;
+
+	do {
+		ret = recvmmsg(cl->fd, cl->rmsgs, BATCH_SIZE, MSG_DONTWAIT,
+			       NULL);
+		if (ret <= 0)
+			break;
+
+		now = now_ns();
+		count = 0;
+
+		for (i = 0; i < ret; i++) {
+			struct header *hdr = (struct header *)cl->bufs[i];
+
+			if (cl->rmsgs[i].msg_len < SEQ_HDR_LEN ||
+			    hdr->type != TYPE_SEQ_NUM)
+				continue;
+
+			memcpy(&seq, hdr->value, sizeof(seq));
+			seq = ntohl(seq);
+
+			if ((int)(seq - first_seq) < 0)
+				continue;
+
+			t->received++;
+			count++;
+
+			/* Too old, the send time was overwritten */
+			if (cl->pkt_seq - seq > LAT_RING)
+				continue;
+
+			lat_add(&t->lat, now - cl->sent_ns[seq % LAT_RING]);
+		}
+
+		timeline_add(&cl->tl, now, 0, count);
+	} while (ret == BATCH_SIZE);
+}
+
+/* Average payload length, used to turn bit/s into packets/s */
+static int average_len(int data_size)
+{
+	int i, sum = 0;
+
+	for (i = 0; data[i].buf; i++)
+		sum += data_size ? min(data[i].len, data_size) : data[i].len;
+
+	return sum / i;
+}
+
+/* Parse "<num>[k|M|G][pps|bps]" into packets per second. Bit rates count
+ * the UDP payload only.
+ */
+static double parse_rate(const char *str, int pkt_len)
+{
+	char *end;
+	double rate;
+
+	rate = strtod(str, &end);
+
+	switch (*end) {
+	case 'k':
+		rate *= 1e3;
+		end++;
+		break;
+	case 'M':
+		rate *= 1e6;
+		end++;
+		break;
+	case 'G':
+		rate *= 1e9;
+		end++;
+		break;
+	}
+
+	if (!strcmp(end, "bps"))
+		rate /= pkt_len * 8;
+	else if (*end && strcmp(end, "pps"))
+		return -1;
+
+	return rate;
+}
+
+/* Parse the -s size: 0 for the data as is, else from a sequence header
+ * up to max bytes. Returns -1 if it is not such a number.
+ */
+static int parse_size(const char *str, long max)
+{
+	char *end;
+	long size;
+
+	errno = 0;
+	size = strtol(str, &end, 10);
+	if (errno || end == str || *end)
+		return -1;
+
+	if (size && (size < SEQ_HDR_LEN || size > max))
+		return -1;
+
+	return size;
+}
+
+/* Send at a fixed rate, in bursts of "burst" packets, for "duration"
+ * seconds (0 means until interrupted). Replies are counted as they are
+ * drained between the bursts and for a grace period at the end.
+ */
+static int rate_run(struct client *cl, double rate, int burst,
+		    int duration, struct trial *t)
+{
+	uint64_t interval = NSEC_PER_SEC * burst / rate;
+	uint64_t next = now_ns(), end = 0, now;
+	unsigned first_seq = cl->pkt_seq;
+	struct timespec ts;
+	unsigned long long feedback = 1000;
+	int i, ret;
+
+	memset(t, 0, sizeof(*t));
+	t->rate = rate;
+
+	if (duration)
+		end = next + duration * NSEC_PER_SEC;
+
+	while (!do_exit) {
+		for (i = 0; i < burst; i += BATCH_SIZE) {
+			ret = send_batch(cl, min(burst - i, BATCH_SIZE));
+			if (ret < 0 && errno != ENOBUFS && errno != EAGAIN) {
+				perror("send");
+				return ret;
+			}
+
+			if (ret > 0)
+				t->sent += ret;
+		}
+
+		/* Print some feedback to the user every X packets */
+		if (t->sent >= feedback && !cl->quiet) {
+			printf(".");
+			fflush(stdout);
+			feedback += 1000;
+		}
+
+		drain_replies(cl, first_seq, t);
+
+		next += interval;
+		if (end && next >= end)
+			break;
+
+		/* Do not try to catch up after a long stall, that would
+		 * just send one huge burst.
+		 */
+		now = now_ns();
+		if (now > next + MAX_SEND_LAG_NS)
+			next = now;
+
+		/* Wait for the next deadline, picking up the replies as
+		 * they arrive so that their round trip time is accurate.
+		 */
+		while (now < next && !do_exit) {
+			struct pollfd pfd = { .fd = cl->fd, .events = POLLIN };
+
+			ts.tv_sec = (next - now) / NSEC_PER_SEC;
+			ts.tv_nsec = (next - now) % NSEC_PER_SEC;
+
+			if (ppoll(&pfd, 1, &ts, NULL) > 0)
+				drain_replies(cl, first_seq, t);
+
+			now = now_ns();
+		}
+	}
+
+	end = now_ns() + REPLY_GRACE_MS * 1000000ULL;
+	while ((now = now_ns()) < end && t->received < t->sent) {
+		struct pollfd pfd = { .fd = cl->fd, .events = POLLIN };
+
+		if (poll(&pfd, 1, (end - now) / 1000000 + 1) <= 0)
+			break;
+
+		drain_replies(cl, first_seq, t);
+	}
+
+	if (!cl->quiet)
+		printf("\n");
+
+	return 0;
+}
+
+/* Send as fast as possible in batches, draining the replies after every
+ * batch, for "duration" seconds or until interrupted.
+ */
+static int flood_run(struct client *cl, int duration, struct trial *t)
+{
+	uint64_t start = now_ns(), end = 0, report, now;
+	unsigned first_seq = cl->pkt_seq;
+	unsigned long long last_sent = 0;
+	int ret;
+
+	memset(t, 0, sizeof(*t));
+
+	if (duration)
+		end = start + duration * NSEC_PER_SEC;
+
+	report = start + NSEC_PER_SEC;
+
+	while (!do_exit) {
+		if (cl->gso) {
+			ret = send_batch_gso(cl);
+			if (ret < 0 && (errno == EIO || errno == EINVAL ||
+					errno == ENOPROTOOPT) && !t->sent) {
+				fprintf(stderr, "UDP GSO not supported (%s), "
+					"using sendmmsg\n", strerror(errno));
+				cl->gso = false;
+				continue;
+			}
+		} else {
+			ret = send_batch(cl, BATCH_SIZE);
+		}
+
+		if (ret < 0 && errno != ENOBUFS && errno != EAGAIN) {
+			perror("send");
+			return ret;
+		}
+
+		if (ret > 0)
+			t->sent += ret;
+
+		drain_replies(cl, first_seq, t);
+
+		now = now_ns();
+		if (now >= report) {
+			if (!cl->quiet)
+				printf("%llu pkt/s, %llu replies\n",
+				       t->sent - last_sent, t->received);
+			last_sent = t->sent;
+			report += NSEC_PER_SEC;
+		}
+
+		if (end && now >= end)
+			break;
+	}
+
+	t->rate = t->sent * (double)NSEC_PER_SEC / (now_ns() - start);
+
+	return 0;
+}
+
+static void print_trial(const struct trial *t, int pkt_len)
+{
+	printf("%12.0f pps %10.3f Mbit/s sent %llu received %llu "
+	       "loss %.3f%%", t->rate, t->rate * pkt_len * 8 / 1e6,
+	       t->sent, t->received,
+	       t->sent ? 100.0 * (t->sent - t->received) / t->sent : 0);
+
+	if (t->lat.count)
+		printf(" rtt min/avg/max %.1f/%.1f/%.1f us",
+		       t->lat.min / 1e3,
+		       (double)t->lat.sum / t->lat.count / 1e3,
+		       t->lat.max / 1e3);
+
+	printf("\n");
+}
+
+static void trial_add(struct trial *sum, const struct trial *t)
+{
+	sum->rate += t->rate;
+	sum->sent += t->sent;
+	sum->received += t->received;
+	lat_merge(&sum->lat, &t->lat);
+}
+
+/* One snapshot per second in the TCP mode */
+struct tcp_sample {
+	unsigned long long written;	/* handed to the socket */
+	unsigned long long acked;	/* acked by the peer */
+	unsigned long long received;	/* data sent back by the peer */
+	unsigned cwnd;			/* in segments */
+	unsigned rtt;			/* in us */
+	unsigned rttvar;
+	unsigned retrans;		/* total so far */
+};
+
+/* Everything that goes to the -o results file, filled in as the run
+ * goes and written out once at the end.
+ */
+static struct {
+	const char *mode;
+	const char *target;
+	int port;
+	double rate;
+	int burst;
+	int duration;
+	int threads;
+	int data_size;
+	int pkt_len;
+	bool gso;
+	double max_loss;
+
+	struct trial total;
+	struct timeline tl;
+	unsigned long long *timeouts;	/* per data[] index, lock-step only */
+
+	struct trial steps[MAX_RATE_STEPS];
+	int step_count;
+	double best_rate;
+
+	bool zerocopy;
+	struct tcp_sample tcp_total;
+	double tcp_secs;
+	struct tcp_sample *tcp;
+	size_t tcp_count;
+	size_t tcp_alloc;
+	unsigned long long zc_sent;	/* MSG_ZEROCOPY sends */
+	unsigned long long zc_done;	/* completions */
+	unsigned long long zc_copied;	/* completions that fell back to copy */
+} res;
+
+static int compare_trials(const void *a, const void *b)
+{
+	const struct trial *ta = a, *tb = b;
+
+	return (ta->rate > tb->rate) - (ta->rate < tb->rate);
+}
+
+/* Binary search for the highest rate whose loss stays at or below
+ * max_loss percent, the same way as the RFC 2544 throughput test. Every
+ * step is one point of the throughput vs. loss curve printed at the end.
+ */
+static int rate_search(struct client *cl, double max_rate, int burst,
+		       int duration, double max_loss, int pkt_len)
+{
+	struct trial trials[MAX_RATE_STEPS];
+	double lo = 0, hi = max_rate, rate = max_rate;
+	int steps = 0, i, ret;
+
+	while (steps < MAX_RATE_STEPS && !do_exit) {
+		struct trial *t = &trials[steps];
+		double loss;
+
+		printf("Step %d: %.0f pps for %d s\n", steps + 1, rate,
+		       duration);
+
+		ret = rate_run(cl, rate, burst, duration, t);
+		if (ret < 0)
+			return ret;
+
+		steps++;
+
+		loss = t->sent ? 100.0 * (t->sent - t->received) / t->sent
+			: 100.0;
+		print_trial(t, pkt_len);
+
+		if (loss <= max_loss)
+			lo = rate;
+		else
+			hi = rate;
+
+		if (lo == max_rate || hi - lo <= max_rate * RATE_RESOLUTION)
+			break;
+
+		rate = (lo + hi) / 2;
+	}
+
+	qsort(trials, steps, sizeof(trials[0]), compare_trials);
+
+	printf("\nThroughput vs. loss:\n");
+	for (i = 0; i < steps; i++) {
+		print_trial(&trials[i], pkt_len);
+		trial_add(&res.total, &trials[i]);
+	}
+
+	/* The packets add up over the steps, their rates do not: the
+	 * summary rate is the one found
+	 */
+	res.total.rate = lo;
+
+	memcpy(res.steps, trials, steps * sizeof(trials[0]));
+	res.step_count = steps;
+	res.best_rate = lo;
+
+	printf("\nHighest rate with loss <= %.3f%%: %.0f pps "
+	       "(%.3f Mbit/s)\n", max_loss, lo, lo * pkt_len * 8 / 1e6);
+
+	return 0;
+}
+
+/* TCP mode: stream a repeating lorem_ipsum from one pre-generated buffer
+ * with large non-blocking writes, optionally with MSG_ZEROCOPY, and throw
+ * away anything the peer sends back. Every second the goodput, i.e. the
+ * bytes acked by the peer, and the TCP_INFO state are printed and kept for
+ * the results file.
+ */
+static void tcp_sample_add(const struct tcp_sample *sample)
+{
+	if (res.tcp_count == res.tcp_alloc) {
+		size_t alloc = res.tcp_alloc ? res.tcp_alloc * 2 : 64;
+		struct tcp_sample *tcp;
+
+		tcp = realloc(res.tcp, alloc * sizeof(*tcp));
+		if (!tcp)
+			return;
+
+		res.tcp = tcp;
+		res.tcp_alloc = alloc;
+	}
+
+	res.tcp[res.tcp_count++] = *sample;
+}
+
+/* Read the MSG_ZEROCOPY completions. The buffer is never modified so
+ * they are only counted, but they have to be read or the socket runs out
+ * of option memory.
+ */
+static void tcp_zerocopy_drain(int fd)
+{
+	char control[CMSG_SPACE(sizeof(struct sock_extended_err)) + 64];
+	struct sock_extended_err *serr;
+	struct msghdr msg;
+	struct cmsghdr *cmsg;
+
+	while (1) {
+		memset(&msg, 0, sizeof(msg));
+		msg.msg_control = control;
+		msg.msg_controllen = sizeof(control);
+
+		if (recvmsg(fd, &msg, MSG_ERRQUEUE | MSG_DONTWAIT) < 0)
+			break;
+
+		for (cmsg = CMSG_FIRSTHDR(&msg); cmsg;
+		     cmsg = CMSG_NXTHDR(&msg, cmsg)) {
+			unsigned count;
+
+			serr = (struct sock_extended_err *)CMSG_DATA(cmsg);
+			if (serr->ee_errno != 0 ||
+			    serr->ee_origin != SO_EE_ORIGIN_ZEROCOPY)
+				continue;
+
+			/* The range ee_info..ee_data of sends is done */
+			count = serr->ee_data - serr->ee_info + 1;
+
+			res.zc_done += count;
+			if (serr->ee_code & SO_EE_CODE_ZEROCOPY_COPIED)
+				res.zc_copied += count;
+		}
+	}
+}
+
+/* tcpi_bytes_acked counts the SYN too */
+static unsigned long long tcp_acked(const struct tcp_info *info)
+{
+	return info->tcpi_bytes_acked ? info->tcpi_bytes_acked - 1 : 0;
+}
+
+static int tcp_run(int fd, int write_size, bool zerocopy, int duration,
+		   bool quiet)
+{
+	size_t pattern = sizeof(lorem_ipsum);
+	uint64_t start = now_ns(), end = 0, report, now;
+	unsigned long long written = 0, received = 0, acked = 0;
+	struct tcp_sample sample;
+	struct tcp_info info;
+	socklen_t len;
+	unsigned char *buf, scratch[MAX_BUF_SIZE];
+	bool wait_zc = false;
+	int flags = MSG_DONTWAIT | MSG_NOSIGNAL, ret = 0, i;
+
+	buf = malloc(write_size + pattern);
+	if (!buf)
+		return -ENOMEM;
+
+	for (i = 0; i < write_size + pattern; i += pattern)
+		memcpy(buf + i, lorem_ipsum,
+		       min(pattern, (size_t)(write_size + pattern - i)));
+
+	if (zerocopy) {
+		int optval = 1;
+
+		if (setsockopt(fd, SOL_SOCKET, SO_ZEROCOPY, &optval,
+			       sizeof(optval)) < 0)
+			fprintf(stderr, "MSG_ZEROCOPY not supported (%s), "
+				"copying\n", strerror(errno));
+		else
+			flags |= MSG_ZEROCOPY;
+	}
+
+	fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+
+	if (duration)
+		end = start + duration * NSEC_PER_SEC;
+
+	report = start + NSEC_PER_SEC;
+
+	while (!do_exit) {
+		struct pollfd pfd = { .fd = fd, .events = POLLIN };
+
+		if (!wait_zc)
+			pfd.events |= POLLOUT;
+
+		now = now_ns();
+
+		if (poll(&pfd, 1, report > now ?
+			 (report - now) / 1000000 + 1 : 0) < 0) {
+			if (errno == EINTR)
+				continue;
+
+			perror("poll");
+			ret = -errno;
+			break;
+		}
+
+		if (pfd.revents & POLLERR) {
+			tcp_zerocopy_drain(fd);
+			wait_zc = false;
+		}
+
+		if (pfd.revents & POLLIN) {
+			do {
+				ret = recv(fd, scratch, sizeof(scratch),
+					   MSG_DONTWAIT);
+				if (ret > 0)
+					received += ret;
+			} while (ret > 0);
+
+			if (ret == 0) {
+				printf("Connection closed by peer.\n");
+				ret = -ECONNRESET;
+				break;
+			}
+		}
+
+		if (pfd.revents & POLLOUT) {
+			ret = send(fd, buf + written % pattern, write_size,
+				   flags);
+			if (ret > 0) {
+				written += ret;
+				if (flags & MSG_ZEROCOPY)
+					res.zc_sent++;
+			} else if (errno == ENOBUFS && (flags & MSG_ZEROCOPY)) {
+				/* Out of option memory, wait for completions */
+				wait_zc = true;
+			} else if (errno != EAGAIN) {
+				perror("send");
+				ret = -errno;
+				break;
+			}
+		}
+
+		ret = 0;
+		now = now_ns();
+		if (now < report)
+			continue;
+
+		len = sizeof(info);
+		memset(&info, 0, sizeof(info));
+		getsockopt(fd, IPPROTO_TCP, TCP_INFO, &info, &len);
+
+		sample.written = written;
+		sample.acked = tcp_acked(&info);
+		sample.received = received;
+		sample.cwnd = info.tcpi_snd_cwnd;
+		sample.rtt = info.tcpi_rtt;
+		sample.rttvar = info.tcpi_rttvar;
+		sample.retrans = info.tcpi_total_retrans;
+
+		tcp_sample_add(&sample);
+
+		if (!quiet)
+			printf("%4zu s %10.3f Mbit/s goodput, cwnd %u "
+			       "rtt %u/%u us retrans %u\n", res.tcp_count,
+			       (sample.acked - acked) * 8 / 1e6, sample.cwnd,
+			       sample.rtt, sample.rttvar, sample.retrans);
+
+		acked = sample.acked;
+		report += NSEC_PER_SEC;
+
+		if (end && now >= end)
+			break;
+	}
+
+	if (flags & MSG_ZEROCOPY)
+		tcp_zerocopy_drain(fd);
+
+	len = sizeof(info);
+	memset(&info, 0, sizeof(info));
+	getsockopt(fd, IPPROTO_TCP, TCP_INFO, &info, &len);
+
+	now = now_ns();
+
+	printf("Wrote %llu bytes, %llu acked, %.3f Mbit/s goodput, "
+	       "%u retransmits\n", written, tcp_acked(&info),
+	       tcp_acked(&info) * 8 * 1e3 / (now - start),
+	       info.tcpi_total_retrans);
+
+	if (flags & MSG_ZEROCOPY)
+		printf("MSG_ZEROCOPY: %llu sends, %llu completed, "
+		       "%llu copied\n", res.zc_sent, res.zc_done,
+		       res.zc_copied);
+
+	res.tcp_total.written = written;
+	res.tcp_total.acked = tcp_acked(&info);
+	res.tcp_total.received = received;
+	res.tcp_total.cwnd = info.tcpi_snd_cwnd;
+	res.tcp_total.rtt = info.tcpi_rtt;
+	res.tcp_total.rttvar = info.tcpi_rttvar;
+	res.tcp_total.retrans = info.tcpi_total_retrans;
+	res.tcp_secs = (now - start) / 1e9;
+
+	free(buf);
+
+	return ret;
+}
+
+/* Multi-threaded mode: every thread has its own socket, source port and
+ * sequence numbers, and all of them start sending at the same time.
+ */
+struct worker {
+	pthread_t thread;
+	int cpu;
+	struct client *cl;
+	struct trial t;
+	int ret;
+};
+
+static struct {
+	/* Start barrier: the threads wait until "go" is set */
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+	bool go;
+	double rate;		/* per thread, 0 means flood */
+	int burst;
+	int duration;
+	bool gso;
+} run;
+
+static void *worker_run(void *arg)
+{
+	struct worker *w = arg;
+
+	if (w->cpu >= 0) {
+		cpu_set_t set;
+
+		CPU_ZERO(&set);
+		CPU_SET(w->cpu, &set);
+
+		if (pthread_setaffinity_np(pthread_self(), sizeof(set), &set))
+			fprintf(stderr, "Cannot pin thread to cpu %d\n",
+				w->cpu);
+	}
+
+	if (run.gso && gso_init(w->cl) < 0)
+		fprintf(stderr, "Not using UDP GSO\n");
+
+	pthread_mutex_lock(&run.lock);
+	while (!run.go)
+		pthread_cond_wait(&run.cond, &run.lock);
+	pthread_mutex_unlock(&run.lock);
+
+	if (run.rate)
+		w->ret = rate_run(w->cl, run.rate, run.burst, run.duration,
+				  &w->t);
+	else
+		w->ret = flood_run(w->cl, run.duration, &w->t);
+
+	return NULL;
+}
+
+static int run_threads(int threads, struct client *cl, int family,
+		       const char *interface,
+		       const struct sockaddr *addr_recv, int pkt_len)
+{
+	struct worker workers[MAX_THREADS] = {};
+	struct trial total = {};
+	cpu_set_t allowed;
+	int i, cpu = -1, ret = 0, started = 0;
+
+	if (sched_getaffinity(0, sizeof(allowed), &allowed) < 0)
+		CPU_ZERO(&allowed);
+
+	pthread_mutex_init(&run.lock, NULL);
+	pthread_cond_init(&run.cond, NULL);
+	run.go = false;
+
+	for (i = 0; i < threads; i++) {
+		struct worker *w = &workers[i];
+
+		/* Spread the threads over the cpus we are allowed to use */
+		if (CPU_COUNT(&allowed)) {
+			do {
+				cpu = (cpu + 1) % CPU_SETSIZE;
+			} while (!CPU_ISSET(cpu, &allowed));
+		}
+
+		w->cpu = cpu;
+
+		if (i == 0) {
+			w->cl = cl;
+		} else {
+			int fd = client_socket(family, interface, addr_recv,
+					       cl->addr_len);
+
+			if (fd < 0) {
+				fprintf(stderr, "Cannot create socket for "
+					"thread %d: %s\n", i, strerror(-fd));
+				ret = fd;
+				break;
+			}
+
+			w->cl = calloc(1, sizeof(*w->cl));
+			if (!w->cl) {
+				close(fd);
+				ret = -ENOMEM;
+				break;
+			}
+
+			client_init(w->cl, fd, cl->addr_send, cl->addr_len,
+				    cl->data_size);
+		}
+
+		w->cl->quiet = true;
+	}
+
+	if (ret < 0) {
+		threads = i;
+		goto out;
+	}
+
+	printf("Running %d threads\n", threads);
+
+	for (i = 0; i < threads; i++) {
+		if (pthread_create(&workers[i].thread, NULL, worker_run,
+				   &workers[i])) {
+			fprintf(stderr, "Cannot start thread %d\n", i);
+			ret = -EAGAIN;
+			do_exit = true;
+			break;
+		}
+
+		started++;
+	}
+
+	/* Let all of them go at once. If some thread could not be
+	 * created, do_exit makes the others return right away.
+	 */
+	pthread_mutex_lock(&run.lock);
+	run.go = true;
+	pthread_cond_broadcast(&run.cond);
+	pthread_mutex_unlock(&run.lock);
+
+	for (i = 0; i < started; i++) {
+		struct worker *w = &workers[i];
+		struct sockaddr_storage local;
+		socklen_t len = sizeof(local);
+		int port = 0;
+
+		pthread_join(w->thread, NULL);
+
+		if (!getsockname(w->cl->fd, (struct sockaddr *)&local, &len))
+			port = ntohs(family == AF_INET ?
+				     ((struct sockaddr_in *)&local)->sin_port :
+				     ((struct sockaddr_in6 *)&local)->sin6_port);
+
+		printf("Thread %d port %d cpu %d:", i, port, w->cpu);
+		print_trial(&w->t, pkt_len);
+
+		if (w->ret < 0)
+			ret = w->ret;
+
+		trial_add(&total, &w->t);
+		timeline_merge(&res.tl, &w->cl->tl);
+	}
+
+	printf("Total:");
+	print_trial(&total, pkt_len);
+
+	res.total = total;
+
+out:
+	for (i = 1; i < threads; i++) {
+		if (!workers[i].cl)
+			continue;
+
+		close(workers[i].cl->fd);
+		free(workers[i].cl->tl.iv);
+		free(workers[i].cl);
+	}
+
+	pthread_cond_destroy(&run.cond);
+	pthread_mutex_destroy(&run.lock);
+
+	return ret;
+}
+
+static unsigned long long trial_lost(const struct trial *t)
+{
+	return t->sent > t->received ? t->sent - t->received : 0;
+}
+
+static double trial_loss(const struct trial *t)
+{
+	return t->sent ? 100.0 * trial_lost(t) / t->sent : 0;
+}
+
+static void write_json(FILE *fp)
+{
+	const struct trial *t = &res.total;
+	size_t i;
+
+	fprintf(fp, "{\n  \"tool\": \"throughput-client\",\n");
+
+	fprintf(fp, "  \"parameters\": {\"mode\": \"%s\", \"target\": ",
+		res.mode);
+	results_json_string(fp, res.target);
+	fprintf(fp, ", \"port\": %d, \"rate_pps\": %.0f, \"burst\": %d, "
+		"\"duration_s\": %d, \"threads\": %d, \"data_size\": %d, "
+		"\"packet_len\": %d, \"gso\": %s, \"max_loss_pct\": %g},\n",
+		res.port, res.rate, res.burst,
+		res.duration, res.threads, res.data_size, res.pkt_len,
+		res.gso ? "true" : "false", res.max_loss);
+
+	fprintf(fp, "  \"summary\": {\"sent\": %llu, \"received\": %llu, "
+		"\"lost\": %llu, \"loss_pct\": %.3f, \"rate_pps\": %.0f, "
+		"\"mbit_s\": %.3f},\n", t->sent, t->received, trial_lost(t),
+		trial_loss(t), t->rate, t->rate * res.pkt_len * 8 / 1e6);
+
+	results_json_latency(fp, &t->lat, 1e3);
+
+	fprintf(fp, "  \"intervals\": [");
+	for (i = 0; i < res.tl.count; i++)
+		fprintf(fp, "%s\n    {\"second\": %zu, \"sent\": %llu, "
+			"\"received\": %llu, \"mbit_s\": %.3f}",
+			i ? "," : "", i, res.tl.iv[i].sent,
+			res.tl.iv[i].received,
+			res.tl.iv[i].sent * res.pkt_len * 8 / 1e6);
+	fprintf(fp, "%s],\n", res.tl.count ? "\n  " : "");
+
+	fprintf(fp, "  \"timeouts\": [");
+	for (i = 0; res.timeouts && i < (size_t)data_count; i++)
+		fprintf(fp, "%s\n    {\"index\": %zu, \"len\": %d, "
+			"\"count\": %llu}", i ? "," : "", i, data[i].len,
+			res.timeouts[i]);
+	fprintf(fp, "%s]", res.timeouts ? "\n  " : "");
+
+	if (res.step_count) {
+		fprintf(fp, ",\n  \"rate_search\": {\"best_rate_pps\": %.0f, "
+			"\"steps\": [", res.best_rate);
+
+		for (i = 0; i < (size_t)res.step_count; i++) {
+			t = &res.steps[i];
+			fprintf(fp, "%s\n    {\"rate_pps\": %.0f, \"sent\": %llu, "
+				"\"received\": %llu, \"loss_pct\": %.3f}",
+				i ? "," : "", t->rate, t->sent, t->received,
+				trial_loss(t));
+		}
+
+		fprintf(fp, "\n  ]}");
+	}
+
+	if (res.tcp_secs > 0) {
+		const struct tcp_sample *ts = &res.tcp_total;
+
+		fprintf(fp, ",\n  \"tcp\": {\"write_size\": %d, "
+			"\"zerocopy\": %s, \"duration_s\": %.3f, "
+			"\"written\": %llu, \"acked\": %llu, "
+			"\"received\": %llu, \"goodput_mbit_s\": %.3f, "
+			"\"retrans\": %u", res.pkt_len,
+			res.zerocopy ? "true" : "false", res.tcp_secs,
+			ts->written, ts->acked, ts->received,
+			ts->acked * 8 / res.tcp_secs / 1e6, ts->retrans);
+
+		if (res.zerocopy)
+			fprintf(fp, ", \"zerocopy_sends\": %llu, "
+				"\"zerocopy_completed\": %llu, "
+				"\"zerocopy_copied\": %llu", res.zc_sent,
+				res.zc_done, res.zc_copied);
+
+		fprintf(fp, ",\n    \"intervals\": [");
+		for (i = 0; i < res.tcp_count; i++) {
+			const struct tcp_sample *prev = i ? &res.tcp[i - 1] :
+				NULL;
+
+			ts = &res.tcp[i];
+			fprintf(fp, "%s\n      {\"second\": %zu, "
+				"\"written\": %llu, \"acked\": %llu, "
+				"\"received\": %llu, \"goodput_mbit_s\": %.3f, "
+				"\"cwnd\": %u, \"rtt_us\": %u, "
+				"\"rttvar_us\": %u, \"retrans\": %u}",
+				i ? "," : "", i,
+				ts->written - (prev ? prev->written : 0),
+				ts->acked - (prev ? prev->acked : 0),
+				ts->received - (prev ? prev->received : 0),
+				(ts->acked - (prev ? prev->acked : 0)) * 8 / 1e6,
+				ts->cwnd, ts->rtt, ts->rttvar, ts->retrans);
+		}
+		fprintf(fp, "%s]}", res.tcp_count ? "\n    " : "");
+	}
+
+	fprintf(fp, "\n}\n");
+}
+
+/* One value per line, so that the file can be loaded as a single table */
+static void write_csv(FILE *fp)
+{
+	const struct trial *t = &res.total;
+	size_t i;
+
+	fprintf(fp, "section,name,index,value\n");
+
+	fprintf(fp, "parameter,mode,,%s\n", res.mode);
+	fprintf(fp, "parameter,target,,%s\n", res.target);
+	fprintf(fp, "parameter,port,,%d\n", res.port);
+	fprintf(fp, "parameter,rate_pps,,%.0f\n", res.rate);
+	fprintf(fp, "parameter,burst,,%d\n", res.burst);
+	fprintf(fp, "parameter,duration_s,,%d\n", res.duration);
+	fprintf(fp, "parameter,threads,,%d\n", res.threads);
+	fprintf(fp, "parameter,data_size,,%d\n", res.data_size);
+	fprintf(fp, "parameter,packet_len,,%d\n", res.pkt_len);
+	fprintf(fp, "parameter,gso,,%d\n", res.gso);
+	fprintf(fp, "parameter,max_loss_pct,,%g\n", res.max_loss);
+
+	fprintf(fp, "summary,sent,,%llu\n", t->sent);
+	fprintf(fp, "summary,received,,%llu\n", t->received);
+	fprintf(fp, "summary,lost,,%llu\n", trial_lost(t));
+	fprintf(fp, "summary,loss_pct,,%.3f\n", trial_loss(t));
+	fprintf(fp, "summary,rate_pps,,%.0f\n", t->rate);
+	fprintf(fp, "summary,mbit_s,,%.3f\n", t->rate * res.pkt_len * 8 / 1e6);
+
+	results_csv_latency(fp, &t->lat, 1e3);
+
+	for (i = 0; i < res.tl.count; i++) {
+		fprintf(fp, "interval,sent,%zu,%llu\n", i, res.tl.iv[i].sent);
+		fprintf(fp, "interval,received,%zu,%llu\n", i,
+			res.tl.iv[i].received);
+		fprintf(fp, "interval,mbit_s,%zu,%.3f\n", i,
+			res.tl.iv[i].sent * res.pkt_len * 8 / 1e6);
+	}
+
+	for (i = 0; res.timeouts && i < (size_t)data_count; i++)
+		fprintf(fp, "timeout,count,%zu,%llu\n", i, res.timeouts[i]);
+
+	if (res.step_count)
+		fprintf(fp, "rate_search,best_rate_pps,,%.0f\n", res.best_rate);
+
+	for (i = 0; i < (size_t)res.step_count; i++) {
+		t = &res.steps[i];
+		fprintf(fp, "rate_step,rate_pps,%zu,%.0f\n", i, t->rate);
+		fprintf(fp, "rate_step,sent,%zu,%llu\n", i, t->sent);
+		fprintf(fp, "rate_step,received,%zu,%llu\n", i, t->received);
+		fprintf(fp, "rate_step,loss_pct,%zu,%.3f\n", i, trial_loss(t));
+	}
+
+	if (res.tcp_secs > 0) {
+		const struct tcp_sample *ts = &res.tcp_total;
+
+		fprintf(fp, "tcp,zerocopy,,%d\n", res.zerocopy);
+		fprintf(fp, "tcp,duration_s,,%.3f\n", res.tcp_secs);
+		fprintf(fp, "tcp,written,,%llu\n", ts->written);
+		fprintf(fp, "tcp,acked,,%llu\n", ts->acked);
+		fprintf(fp, "tcp,received,,%llu\n", ts->received);
+		fprintf(fp, "tcp,goodput_mbit_s,,%.3f\n",
+			ts->acked * 8 / res.tcp_secs / 1e6);
+		fprintf(fp, "tcp,retrans,,%u\n", ts->retrans);
+
+		if (res.zerocopy) {
+			fprintf(fp, "tcp,zerocopy_sends,,%llu\n", res.zc_sent);
+			fprintf(fp, "tcp,zerocopy_completed,,%llu\n",
+				res.zc_done);
+			fprintf(fp, "tcp,zerocopy_copied,,%llu\n",
+				res.zc_copied);
+		}
+	}
+
+	for (i = 0; i < res.tcp_count; i++) {
+		const struct tcp_sample *ts = &res.tcp[i];
+		const struct tcp_sample *prev = i ? &res.tcp[i - 1] : NULL;
+
+		fprintf(fp, "tcp_interval,written,%zu,%llu\n", i,
+			ts->written - (prev ? prev->written : 0));
+		fprintf(fp, "tcp_interval,acked,%zu,%llu\n", i,
+			ts->acked - (prev ? prev->acked : 0));
+		fprintf(fp, "tcp_interval,received,%zu,%llu\n", i,
+			ts->received - (prev ? prev->received : 0));
+		fprintf(fp, "tcp_interval,goodput_mbit_s,%zu,%.3f\n", i,
+			(ts->acked - (prev ? prev->acked : 0)) * 8 / 1e6);
+		fprintf(fp, "tcp_interval,cwnd,%zu,%u\n", i, ts->cwnd);
+		fprintf(fp, "tcp_interval,rtt_us,%zu,%u\n", i, ts->rtt);
+		fprintf(fp, "tcp_interval,rttvar_us,%zu,%u\n", i, ts->rttvar);
+		fprintf(fp, "tcp_interval,retrans,%zu,%u\n", i, ts->retrans);
+	}
+}
+
 /* The application returns:
  *    < 0 : connection or similar error
  *      0 : no errors, all tests passed
@@ -355,10 +1729,18 @@ int main(int argc, char**argv)
 	bool forever = true, help = false, do_reverse = false;
 	int data_size = 0;
 	unsigned pkt_seq = 0;
+	const char *rate_spec = NULL, *size_spec = NULL;
+	bool rate_step = false, gso = false, tcp = false, zerocopy = false;
+	int threads = 1;
+	struct client *cl;
+	int burst = 1, duration = 0;
+	double max_loss = 0;
+	const char *results = NULL;
+	uint64_t sent_at;
 
 	opterr = 0;
 
-	while ((c = getopt(argc, argv, "Fi:p:hs:")) != -1) {
+	while ((c = getopt(argc, argv, "Fi:p:hs:r:b:d:Al:GT:o:tZ")) != -1) {
 		switch (c) {
 		case 'F':
 			flood = true;
@@ -370,7 +1752,37 @@ int main(int argc, char**argv)
 			port = atoi(optarg);
 			break;
 		case 's':
-			data_size = atoi(optarg);
+			size_spec = optarg;
+			break;
+		case 'r':
+			rate_spec = optarg;
+			break;
+		case 'b':
+			burst = atoi(optarg);
+			break;
+		case 'd':
+			duration = atoi(optarg);
+			break;
+		case 'A':
+			rate_step = true;
+			break;
+		case 'G':
+			gso = true;
+			break;
+		case 'T':
+			threads = atoi(optarg);
+			break;
+		case 'l':
+			max_loss = strtod(optarg, NULL);
+			break;
+		case 'o':
+			results = optarg;
+			break;
+		case 't':
+			tcp = true;
+			break;
+		case 'Z':
+			zerocopy = true;
 			break;
 		case 'h':
 			help = true;
@@ -381,6 +1793,28 @@ int main(int argc, char**argv)
 	if (optind < argc)
 		target = argv[optind];
 
+	if (rate_step && !rate_spec)
+		help = true;
+
+	if (threads < 1 || threads > MAX_THREADS ||
+	    (threads > 1 && ((!flood && !rate_spec) || rate_step)))
+		help = true;
+
+	if ((zerocopy && !tcp) ||
+	    (tcp && (flood || rate_spec || threads > 1 || gso)))
+		help = true;
+
+	if (burst < 1)
+		burst = 1;
+
+	if (size_spec) {
+		data_size = parse_size(size_spec, tcp ? INT_MAX : MAX_BUF_SIZE);
+		if (data_size < 0) {
+			printf("Invalid size %s\n", size_spec);
+			exit(-EINVAL);
+		}
+	}
+
 	if (!target || help) {
 		printf("usage: %s [-i iface] [-F] <IPv{6|4} address of the "
 		       "throughput-server>\n", argv[0]);
@@ -389,7 +1823,33 @@ int main(int argc, char**argv)
 		printf("-F (flood) option will prevent the client from "
 		       "waiting the data.\n"
 		       "   The -F option will stress test the server.\n");
-		printf("-s Max data size to send.\n");
+		printf("-s Max data size to send, %d to %d bytes "
+		       "(0 sends the data as is)\n", SEQ_HDR_LEN, MAX_BUF_SIZE);
+		printf("-r Send at this rate instead of waiting for replies, "
+		       "e.g. 5000, 20kpps or 10Mbps\n");
+		printf("-b Send this many packets per timer tick with -r, "
+		       "default is 1\n");
+		printf("-d Run for this many seconds with -r, default is "
+		       "forever (%d s per step with -A)\n",
+		       DEFAULT_TRIAL_TIME);
+		printf("-A Search for the highest rate up to -r with "
+		       "acceptable loss (RFC 2544).\n"
+		       "   The server has to echo the data back.\n");
+		printf("-l Acceptable loss in percent with -A, default is 0\n");
+		printf("-G Use UDP GSO in flood mode if the kernel "
+		       "supports it\n");
+		printf("-T Send from this many threads (max %d), each with "
+		       "its own socket.\n"
+		       "   Needs -F or -r, the -r rate is shared by the "
+		       "threads.\n", MAX_THREADS);
+		printf("-t Stream data over TCP and report the goodput and "
+		       "TCP_INFO every second.\n"
+		       "   -s sets the write size, default is %d\n",
+		       TCP_WRITE_SIZE);
+		printf("-Z Use MSG_ZEROCOPY with -t\n");
+		printf("-o Write the results to this file at exit, as CSV "
+		       "if it ends in .csv\n"
+		       "   and as JSON otherwise\n");
 		exit(-EINVAL);
 	}
 
@@ -429,7 +1889,8 @@ int main(int argc, char**argv)
 	addr_send->sa_family = family;
 	addr_recv->sa_family = family;
 
-	fd = socket(family, SOCK_DGRAM, IPPROTO_UDP);
+	fd = socket(family, tcp ? SOCK_STREAM : SOCK_DGRAM,
+		    tcp ? IPPROTO_TCP : IPPROTO_UDP);
 	if (fd < 0) {
 		perror("socket");
 		exit(-errno);
@@ -485,101 +1946,228 @@ int main(int argc, char**argv)
 		exit(-errno);
 	}
 
-again:
-	do {
-		int sent;
-
-		while (data[i].buf) {
-			struct header *hdr;
-			unsigned seq;
-			int pos = 0;
-			int len;
-
-			if (data_size) {
-				len = min(data[i].len, data_size);
-			} else {
-				len = data[i].len;
-			}
+	if (tcp) {
+		ret = connect(fd, addr_send, addr_len);
+		if (ret < 0) {
+			perror("connect");
+			exit(-errno);
+		}
+	}
 
-			sent = 0;
+	signal(SIGINT, signal_handler);
+	signal(SIGTERM, signal_handler);
 
-			seq = htonl(pkt_seq);
+	res.target = target;
+	res.port = port;
+	res.burst = burst;
+	res.duration = duration;
+	res.threads = threads;
+	res.data_size = data_size;
+	res.pkt_len = average_len(data_size);
+	res.gso = gso;
+	res.max_loss = max_loss;
 
-			hdr = (struct header *)data[i].buf;
-			hdr->type = TYPE_SEQ_NUM;
-			hdr->len = sizeof(seq);
-			memcpy(hdr->value, &seq, sizeof(seq));
+	start_ns = now_ns();
 
-			ret = sendto(fd, data[i].buf, len, 0,
-				     addr_send, addr_len);
-			if (ret < 0) {
-				perror("send");
-				goto out;
-			}
+	if (tcp) {
+		res.mode = "tcp";
+		res.pkt_len = data_size ? data_size : TCP_WRITE_SIZE;
+		res.zerocopy = zerocopy;
 
-			pkt_seq++;
+		ret = tcp_run(fd, res.pkt_len, zerocopy, duration, false);
+		goto out;
+	}
 
-			/* Print some feedback to the user every X packets */
-			if (!(pkt_seq % 1000)) {
-				printf(".");
-				fflush(stdout);
-			}
+	if (rate_spec || flood) {
+		int pkt_len = res.pkt_len;
+		struct trial t;
+		double rate;
 
-			FD_ZERO(&rfds);
-			FD_SET(fd, &rfds);
+		cl = calloc(1, sizeof(*cl));
+		if (!cl) {
+			ret = -ENOMEM;
+			goto out;
+		}
 
-			if (!flood)
-				tv.tv_sec = MAX_TIMEOUT;
-			else
-				tv.tv_sec = 0;
+		client_init(cl, fd, addr_send, addr_len, data_size);
 
-			tv.tv_usec = 0;
+		if (threads > 1) {
+			res.mode = rate_spec ? "rate" : "flood";
 
-			ret = select(fd + 1, &rfds, NULL, NULL, &tv);
-			if (ret < 0) {
-				perror("select");
-				goto out;
-			} else if (ret == 0) {
-				if (!flood && data[i].expecting_reply) {
-					fprintf(stderr,
-						"Timeout while waiting "
-						"idx %d len %d\n",
-						i, data[i].len);
-					timeout = i;
+			run.burst = burst;
+			run.duration = duration;
+			run.gso = gso;
+			run.rate = 0;
+
+			if (rate_spec) {
+				run.rate = parse_rate(rate_spec, pkt_len) /
+					threads;
+				if (run.rate <= 0) {
+					printf("Invalid rate %s\n", rate_spec);
+					ret = -EINVAL;
+					goto out;
 				}
-				i++;
-				continue;
-			} else if (!FD_ISSET(fd, &rfds)) {
-				fprintf(stderr, "Invalid fd\n");
-				ret = i;
-				goto out;
-			}
 
-			ret = recv(fd, buf, sizeof(buf), 0);
-			if (ret <= 0) {
-				perror("recv");
-				ret = -EINVAL;
-				goto out;
+				prctl(PR_SET_TIMERSLACK, 1UL);
+				res.rate = run.rate * threads;
 			}
 
-			if (!flood && (data[i].len != ret ||
-				       memcmp(data[i].buf, buf, ret) != 0)) {
+			ret = run_threads(threads, cl, family, interface,
+					  addr_recv, pkt_len);
+			goto out;
+		}
+
+		if (!rate_spec) {
+			if (gso && gso_init(cl) < 0)
+				printf("Not using UDP GSO\n");
+
+			res.mode = "flood";
+
+			ret = flood_run(cl, duration, &t);
+			if (!ret)
+				print_trial(&t, pkt_len);
+
+			res.total = t;
+			res.tl = cl->tl;
+			goto out;
+		}
+
+		rate = parse_rate(rate_spec, pkt_len);
+		if (rate <= 0) {
+			printf("Invalid rate %s\n", rate_spec);
+			ret = -EINVAL;
+			goto out;
+		}
+
+		/* The timer slack delays the ppoll() timeout in rate_run(),
+		 * keep it minimal to wake up as close to the deadline as
+		 * possible.
+		 */
+		prctl(PR_SET_TIMERSLACK, 1UL);
+
+		res.rate = rate;
+
+		if (rate_step) {
+			res.mode = "rate-search";
+			res.duration = duration ? duration : DEFAULT_TRIAL_TIME;
+
+			ret = rate_search(cl, rate, burst, res.duration,
+					  max_loss, pkt_len);
+		} else {
+			res.mode = "rate";
+
+			ret = rate_run(cl, rate, burst, duration, &t);
+			if (!ret)
+				print_trial(&t, pkt_len);
+
+			res.total = t;
+		}
+
+		res.tl = cl->tl;
+		goto out;
+	}
+
+	res.mode = "lock-step";
+
+	while (data[data_count].buf)
+		data_count++;
+
+	res.timeouts = calloc(data_count, sizeof(*res.timeouts));
+
+again:
+	while (data[i].buf && !do_exit) {
+		struct header *hdr;
+		unsigned seq;
+		int pos = 0;
+		int len;
+
+		if (data_size) {
+			len = min(data[i].len, data_size);
+		} else {
+			len = data[i].len;
+		}
+
+		seq = htonl(pkt_seq);
+
+		hdr = (struct header *)data[i].buf;
+		hdr->type = TYPE_SEQ_NUM;
+		hdr->len = sizeof(seq);
+		memcpy(hdr->value, &seq, sizeof(seq));
+
+		sent_at = now_ns();
+
+		ret = sendto(fd, data[i].buf, len, 0,
+			     addr_send, addr_len);
+		if (ret < 0) {
+			perror("send");
+			goto out;
+		}
+
+		pkt_seq++;
+		res.total.sent++;
+		timeline_add(&res.tl, sent_at, 1, 0);
+
+		/* Print some feedback to the user every X packets */
+		if (!(pkt_seq % 1000)) {
+			printf(".");
+			fflush(stdout);
+		}
+
+		FD_ZERO(&rfds);
+		FD_SET(fd, &rfds);
+
+		tv.tv_sec = MAX_TIMEOUT;
+		tv.tv_usec = 0;
+
+		ret = select(fd + 1, &rfds, NULL, NULL, &tv);
+		if (ret < 0 && errno == EINTR && do_exit) {
+			break;
+		} else if (ret < 0) {
+			perror("select");
+			goto out;
+		} else if (ret == 0) {
+			if (data[i].expecting_reply) {
 				fprintf(stderr,
-					"Check failed idx %d len %d\n",
-					i, ret);
-				ret = i;
-				goto out;
-			}
+					"Timeout while waiting "
+					"idx %d len %d\n",
+					i, data[i].len);
+				timeout = i;
 
+				if (res.timeouts)
+					res.timeouts[i]++;
+			}
 			i++;
+			continue;
+		} else if (!FD_ISSET(fd, &rfds)) {
+			fprintf(stderr, "Invalid fd\n");
+			ret = i;
+			goto out;
 		}
 
-		if (flood)
-			i = 0;
+		ret = recv(fd, buf, sizeof(buf), 0);
+		if (ret <= 0) {
+			perror("recv");
+			ret = -EINVAL;
+			goto out;
+		}
+
+		if (data[i].len != ret ||
+		    memcmp(data[i].buf, buf, ret) != 0) {
+			fprintf(stderr,
+				"Check failed idx %d len %d\n",
+				i, ret);
+			ret = i;
+			goto out;
+		}
 
-	} while (flood);
+		res.total.received++;
+		lat_add(&res.total.lat, now_ns() - sent_at);
+		timeline_add(&res.tl, now_ns(), 0, 1);
 
-	if (forever) {
+		i++;
+	}
+
+	if (forever && !do_exit) {
 		i = 0;
 		goto again;
 	}
@@ -588,7 +2176,13 @@ again:
 
 	printf("\n");
 
+	res.total.rate = res.total.sent * (double)NSEC_PER_SEC /
+		(now_ns() - start_ns);
+
 out:
+	if (results && res.mode)
+		results_write(results, write_json, write_csv);
+
 	close(fd);
 
 	exit(ret);
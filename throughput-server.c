@@ -0,0 +1,550 @@
+/*
+ * Copyright (c) 2018 Intel Corporation
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/* Receive the sequence numbered UDP datagrams sent by throughput-client
+ * (either the host tool or the Zephyr sample) and report loss, reordering,
+ * duplicates and the receive rate per sender.
+ */
+
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <poll.h>
+#include <errno.h>
+#include <arpa/inet.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <net/if.h>
+#include <unistd.h>
+#include <signal.h>
+#include <time.h>
+
+#define SERVER_PORT  42042
+#define MAX_BUF_SIZE 1280	/* min IPv6 MTU, the actual data is smaller */
+#define BATCH_SIZE   64		/* datagrams per recvmmsg() call */
+#define MAX_SENDERS  32
+
+/* Sequence numbers this far behind the highest one seen are remembered
+ * for duplicate detection. Anything older is counted as late.
+ */
+#define SEQ_WINDOW   4096
+/* A sequence number this far behind means the sender was restarted */
+#define SEQ_RESTART  (1 << 20)
+
+#define TYPE_SEQ_NUM 42
+
+struct header {
+	unsigned char type;
+	unsigned char len;
+	unsigned char value[0];
+} __attribute__((packed));
+
+struct counters {
+	uint64_t packets;
+	uint64_t bytes;
+	uint64_t duplicates;
+	uint64_t reordered;
+	uint64_t late;
+	uint64_t gaps;
+	uint32_t max_reorder;
+	struct timespec first;
+	struct timespec last;
+};
+
+struct sender {
+	struct sockaddr_in6 addr;
+	bool used;
+	bool have_seq;
+	uint32_t first_seq;
+	uint32_t max_seq;
+	uint64_t unique;	/* distinct sequence numbers received */
+	uint64_t unsequenced;	/* datagrams without a sequence header */
+	uint64_t seen[SEQ_WINDOW / 64];
+	struct counters total;
+	struct counters window;
+};
+
+static struct sender senders[MAX_SENDERS];
+static uint32_t socket_drops;	/* from SO_RXQ_OVFL */
+static bool do_exit;
+
+static void signal_handler(int sig)
+{
+	do_exit = true;
+}
+
+static inline uint64_t ts_to_ns(const struct timespec *ts)
+{
+	return (uint64_t)ts->tv_sec * 1000000000ULL + ts->tv_nsec;
+}
+
+static inline bool seen_test_and_set(struct sender *s, uint32_t seq)
+{
+	uint32_t bit = seq % SEQ_WINDOW;
+	uint64_t mask = 1ULL << (bit % 64);
+	bool was_set = s->seen[bit / 64] & mask;
+
+	s->seen[bit / 64] |= mask;
+
+	return was_set;
+}
+
+/* Forget the sequence numbers that fall out of the window when the
+ * highest sequence number moves from "from" to "to".
+ */
+static void seen_advance(struct sender *s, uint32_t from, uint32_t to)
+{
+	uint32_t seq;
+
+	if (to - from >= SEQ_WINDOW) {
+		memset(s->seen, 0, sizeof(s->seen));
+		return;
+	}
+
+	for (seq = from + 1; seq != to + 1; seq++)
+		s->seen[(seq % SEQ_WINDOW) / 64] &=
+			~(1ULL << ((seq % SEQ_WINDOW) % 64));
+}
+
+static void sender_reset(struct sender *s, uint32_t seq)
+{
+	s->have_seq = true;
+	s->first_seq = seq;
+	s->max_seq = seq - 1;	/* so that seq is accounted as the next one */
+	s->unique = 0;
+	memset(s->seen, 0, sizeof(s->seen));
+	memset(&s->total, 0, sizeof(s->total));
+	memset(&s->window, 0, sizeof(s->window));
+}
+
+static struct sender *sender_get(const struct sockaddr_in6 *addr)
+{
+	struct sender *free_slot = NULL;
+	int i;
+
+	for (i = 0; i < MAX_SENDERS; i++) {
+		if (!senders[i].used) {
+			if (!free_slot)
+				free_slot = &senders[i];
+			continue;
+		}
+
+		if (senders[i].addr.sin6_port == addr->sin6_port &&
+		    !memcmp(&senders[i].addr.sin6_addr, &addr->sin6_addr,
+			    sizeof(struct in6_addr)))
+			return &senders[i];
+	}
+
+	if (free_slot) {
+		memset(free_slot, 0, sizeof(*free_slot));
+		free_slot->used = true;
+		free_slot->addr = *addr;
+	}
+
+	return free_slot;
+}
+
+static void counters_add(struct counters *c, int len,
+			 const struct timespec *ts)
+{
+	if (!c->packets)
+		c->first = *ts;
+
+	c->last = *ts;
+	c->packets++;
+	c->bytes += len;
+}
+
+static void sender_account(struct sender *s, const unsigned char *buf,
+			   int len, const struct timespec *ts)
+{
+	const struct header *hdr = (const struct header *)buf;
+	uint32_t seq;
+	int32_t diff;
+
+	if (len < (int)(sizeof(*hdr) + sizeof(seq)) ||
+	    hdr->type != TYPE_SEQ_NUM || hdr->len != sizeof(seq)) {
+		s->unsequenced++;
+		return;
+	}
+
+	memcpy(&seq, hdr->value, sizeof(seq));
+	seq = ntohl(seq);
+
+	if (!s->have_seq ||
+	    (int32_t)(seq - s->max_seq) < -(int32_t)SEQ_RESTART)
+		sender_reset(s, seq);
+
+	counters_add(&s->total, len, ts);
+	counters_add(&s->window, len, ts);
+
+	diff = seq - s->max_seq;
+	if (diff > 0) {
+		if (diff > 1) {
+			s->total.gaps++;
+			s->window.gaps++;
+		}
+
+		seen_advance(s, s->max_seq, seq);
+		s->max_seq = seq;
+		seen_test_and_set(s, seq);
+		s->unique++;
+		return;
+	}
+
+	if (-diff >= SEQ_WINDOW) {
+		s->total.late++;
+		s->window.late++;
+		return;
+	}
+
+	if (seen_test_and_set(s, seq)) {
+		s->total.duplicates++;
+		s->window.duplicates++;
+		return;
+	}
+
+	/* Older than the highest sequence number but not seen before:
+	 * it arrived out of order, -diff packets late.
+	 */
+	s->unique++;
+	s->total.reordered++;
+	s->window.reordered++;
+
+	if ((uint32_t)-diff > s->total.max_reorder)
+		s->total.max_reorder = -diff;
+	if ((uint32_t)-diff > s->window.max_reorder)
+		s->window.max_reorder = -diff;
+}
+
+static const char *sender_name(const struct sender *s, char *buf, int len)
+{
+	char addr[INET6_ADDRSTRLEN];
+
+	if (IN6_IS_ADDR_V4MAPPED(&s->addr.sin6_addr))
+		inet_ntop(AF_INET, &s->addr.sin6_addr.s6_addr[12],
+			  addr, sizeof(addr));
+	else
+		inet_ntop(AF_INET6, &s->addr.sin6_addr, addr, sizeof(addr));
+
+	snprintf(buf, len, "%s:%d", addr, ntohs(s->addr.sin6_port));
+
+	return buf;
+}
+
+static void print_counters(const char *prefix, const struct sender *s,
+			   const struct counters *c, double secs)
+{
+	char name[INET6_ADDRSTRLEN + 8];
+
+	if (secs <= 0)
+		secs = 1e-9;
+
+	printf("%s %s: %llu pkts %.0f pkt/s %.1f kbit/s gaps %llu "
+	       "dup %llu reorder %llu (max depth %u) late %llu\n",
+	       prefix, sender_name(s, name, sizeof(name)),
+	       (unsigned long long)c->packets, c->packets / secs,
+	       c->bytes * 8 / secs / 1000,
+	       (unsigned long long)c->gaps,
+	       (unsigned long long)c->duplicates,
+	       (unsigned long long)c->reordered, c->max_reorder,
+	       (unsigned long long)c->late);
+}
+
+static void report_window(double window_secs)
+{
+	int i;
+
+	for (i = 0; i < MAX_SENDERS; i++) {
+		struct sender *s = &senders[i];
+
+		if (!s->used || !s->window.packets)
+			continue;
+
+		print_counters("[window]", s, &s->window, window_secs);
+		memset(&s->window, 0, sizeof(s->window));
+	}
+}
+
+static void report_total(void)
+{
+	int i;
+
+	for (i = 0; i < MAX_SENDERS; i++) {
+		struct sender *s = &senders[i];
+		uint64_t expected;
+		double secs;
+
+		if (!s->used || !s->total.packets)
+			continue;
+
+		secs = (ts_to_ns(&s->total.last) -
+			ts_to_ns(&s->total.first)) / 1e9;
+
+		print_counters("[total]", s, &s->total, secs);
+
+		expected = (uint64_t)(s->max_seq - s->first_seq) + 1;
+		printf("[total] seq %u..%u expected %llu received %llu "
+		       "lost %llu (%.3f%%)",
+		       s->first_seq, s->max_seq,
+		       (unsigned long long)expected,
+		       (unsigned long long)s->unique,
+		       (unsigned long long)(expected - s->unique),
+		       100.0 * (expected - s->unique) / expected);
+
+		if (s->unsequenced)
+			printf(" unsequenced %llu",
+			       (unsigned long long)s->unsequenced);
+
+		printf("\n");
+	}
+}
+
+/* Return the kernel receive timestamp and pick up the socket drop counter */
+static const struct timespec *parse_cmsg(struct msghdr *msg,
+					 struct timespec *fallback)
+{
+	const struct timespec *ts = fallback;
+	struct cmsghdr *cmsg;
+
+	for (cmsg = CMSG_FIRSTHDR(msg); cmsg; cmsg = CMSG_NXTHDR(msg, cmsg)) {
+		if (cmsg->cmsg_level != SOL_SOCKET)
+			continue;
+
+		if (cmsg->cmsg_type == SCM_TIMESTAMPNS)
+			ts = (struct timespec *)CMSG_DATA(cmsg);
+		else if (cmsg->cmsg_type == SO_RXQ_OVFL)
+			memcpy(&socket_drops, CMSG_DATA(cmsg),
+			       sizeof(socket_drops));
+	}
+
+	return ts;
+}
+
+extern int optind, opterr, optopt;
+extern char *optarg;
+
+int main(int argc, char **argv)
+{
+	static unsigned char bufs[BATCH_SIZE][MAX_BUF_SIZE];
+	static char cbufs[BATCH_SIZE][CMSG_SPACE(sizeof(struct timespec)) +
+				      CMSG_SPACE(sizeof(uint32_t))];
+	static struct sockaddr_in6 addrs[BATCH_SIZE];
+	struct mmsghdr msgs[BATCH_SIZE];
+	struct iovec iovs[BATCH_SIZE];
+	struct sockaddr_in6 addr6 = { 0 };
+	const char *interface = NULL;
+	int c, ret, fd, i, port = SERVER_PORT, window = 1;
+	int optval = 1, rcvbuf = 4 * 1024 * 1024;
+	bool echo = false, help = false;
+	struct timespec now, next_report;
+	unsigned long long ignored = 0;
+
+	opterr = 0;
+
+	while ((c = getopt(argc, argv, "i:p:w:eh")) != -1) {
+		switch (c) {
+		case 'i':
+			interface = optarg;
+			break;
+		case 'p':
+			port = atoi(optarg);
+			break;
+		case 'w':
+			window = atoi(optarg);
+			break;
+		case 'e':
+			echo = true;
+			break;
+		case 'h':
+			help = true;
+			break;
+		}
+	}
+
+	if (help || window <= 0) {
+		printf("usage: %s [-i iface] [-p port] [-w secs] [-e]\n",
+		       argv[0]);
+		printf("\n-i Use this network interface\n");
+		printf("-p Use this port, default port is %d\n", SERVER_PORT);
+		printf("-w Report interval in seconds, default is 1\n");
+		printf("-e Echo the datagrams back, needed when "
+		       "throughput-client is\n"
+		       "   not running in flood (-F) mode\n");
+		exit(-EINVAL);
+	}
+
+	fd = socket(AF_INET6, SOCK_DGRAM, IPPROTO_UDP);
+	if (fd < 0) {
+		perror("socket");
+		exit(-errno);
+	}
+
+	/* Accept both IPv6 and IPv4 (mapped) senders */
+	optval = 0;
+	if (setsockopt(fd, IPPROTO_IPV6, IPV6_V6ONLY,
+		       &optval, sizeof(optval)) < 0)
+		perror("IPV6_V6ONLY");
+
+	optval = 1;
+	if (setsockopt(fd, SOL_SOCKET, SO_TIMESTAMPNS,
+		       &optval, sizeof(optval)) < 0)
+		perror("SO_TIMESTAMPNS");
+
+	if (setsockopt(fd, SOL_SOCKET, SO_RCVBUF,
+		       &rcvbuf, sizeof(rcvbuf)) < 0)
+		perror("SO_RCVBUF");
+
+	if (setsockopt(fd, SOL_SOCKET, SO_RXQ_OVFL,
+		       &optval, sizeof(optval)) < 0)
+		perror("SO_RXQ_OVFL");
+
+	if (interface) {
+		struct ifreq ifr;
+
+		memset(&ifr, 0, sizeof(ifr));
+		snprintf(ifr.ifr_name, sizeof(ifr.ifr_name), "%s", interface);
+
+		if (setsockopt(fd, SOL_SOCKET, SO_BINDTODEVICE,
+			       (void *)&ifr, sizeof(ifr)) < 0) {
+			perror("SO_BINDTODEVICE");
+			exit(-errno);
+		}
+	}
+
+	addr6.sin6_family = AF_INET6;
+	addr6.sin6_addr = in6addr_any;
+	addr6.sin6_port = htons(port);
+
+	ret = bind(fd, (struct sockaddr *)&addr6, sizeof(addr6));
+	if (ret < 0) {
+		perror("bind");
+		exit(-errno);
+	}
+
+	signal(SIGINT, signal_handler);
+	signal(SIGTERM, signal_handler);
+
+	printf("Listening on port %d\n", port);
+
+	clock_gettime(CLOCK_MONOTONIC, &next_report);
+	next_report.tv_sec += window;
+
+	while (!do_exit) {
+		struct pollfd pfd = { .fd = fd, .events = POLLIN };
+		int timeout_ms, count, accounted, sent;
+
+		clock_gettime(CLOCK_MONOTONIC, &now);
+		if (ts_to_ns(&now) >= ts_to_ns(&next_report)) {
+			report_window(window);
+			next_report.tv_sec += window;
+			continue;
+		}
+
+		timeout_ms = (ts_to_ns(&next_report) - ts_to_ns(&now)) /
+			1000000 + 1;
+
+		ret = poll(&pfd, 1, timeout_ms);
+		if (ret < 0) {
+			if (errno != EINTR)
+				perror("poll");
+			continue;
+		} else if (ret == 0) {
+			continue;
+		}
+
+		do {
+			for (i = 0; i < BATCH_SIZE; i++) {
+				iovs[i].iov_base = bufs[i];
+				iovs[i].iov_len = MAX_BUF_SIZE;
+
+				memset(&msgs[i], 0, sizeof(msgs[i]));
+				msgs[i].msg_hdr.msg_name = &addrs[i];
+				msgs[i].msg_hdr.msg_namelen = sizeof(addrs[i]);
+				msgs[i].msg_hdr.msg_iov = &iovs[i];
+				msgs[i].msg_hdr.msg_iovlen = 1;
+				msgs[i].msg_hdr.msg_control = cbufs[i];
+				msgs[i].msg_hdr.msg_controllen =
+					sizeof(cbufs[i]);
+			}
+
+			count = recvmmsg(fd, msgs, BATCH_SIZE, MSG_DONTWAIT,
+					 NULL);
+			if (count < 0) {
+				if (errno != EAGAIN && errno != EINTR)
+					perror("recvmmsg");
+				break;
+			}
+
+			clock_gettime(CLOCK_REALTIME, &now);
+
+			for (i = 0, accounted = 0; i < count; i++) {
+				struct msghdr *msg = &msgs[i].msg_hdr;
+				struct sender *s;
+
+				s = sender_get(&addrs[i]);
+				if (!s) {
+					ignored++;
+					continue;
+				}
+
+				sender_account(s, bufs[i], msgs[i].msg_len,
+					       parse_cmsg(msg, &now));
+
+				/* Reuse the vector for the echo, with the
+				 * ignored datagrams left out
+				 */
+				iovs[i].iov_len = msgs[i].msg_len;
+				msg->msg_control = NULL;
+				msg->msg_controllen = 0;
+				msgs[accounted++] = msgs[i];
+			}
+
+			/* A failed message ends a sendmmsg() early, skip it
+			 * and echo the rest
+			 */
+			for (sent = 0; echo && sent < accounted;) {
+				ret = sendmmsg(fd, msgs + sent,
+					       accounted - sent, 0);
+				if (ret > 0) {
+					sent += ret;
+				} else if (errno != EINTR) {
+					perror("sendmmsg");
+					sent++;
+				}
+			}
+		} while (count == BATCH_SIZE);
+	}
+
+	printf("\n");
+	report_total();
+
+	if (socket_drops)
+		printf("Socket receive queue dropped %u datagrams\n",
+		       socket_drops);
+
+	if (ignored)
+		printf("Ignored %llu datagrams from more than %d senders\n",
+		       ignored, MAX_SENDERS);
+
+	close(fd);
+
+	exit(0);
+}
@@ -0,0 +1,206 @@
+/*
+ * Copyright (c) 2018 CPqD Foundation
+ *
+ * SPDX-License-Identifier: Apache-2.0
+ */
+
+#include <stdlib.h>
+
+#include "channel.h"
+#include "eventlog.h"
+
+/* 802.15.4 at 2.4 GHz: 32 us a byte */
+struct channel_params channel = {
+	.bandwidth = 250000,
+	.ge_bad_loss = 1,
+};
+
+static inline uint32_t rotl(uint32_t x, int k)
+{
+	return (x << k) | (x >> (32 - k));
+}
+
+/* xoshiro128** by D. Blackman and S. Vigna */
+static uint32_t rng_next(uint32_t s[4])
+{
+	uint32_t result = rotl(s[1] * 5, 7) * 9;
+	uint32_t t = s[1] << 9;
+
+	s[2] ^= s[0];
+	s[3] ^= s[1];
+	s[1] ^= s[2];
+	s[0] ^= s[3];
+	s[2] ^= t;
+	s[3] = rotl(s[3], 11);
+
+	return result;
+}
+
+/* uniform in [0, 1) */
+static float rng_float(uint32_t s[4])
+{
+	return (rng_next(s) >> 8) * 0x1p-24f;
+}
+
+static uint64_t splitmix64(uint64_t *x)
+{
+	uint64_t z = (*x += 0x9e3779b97f4a7c15ULL);
+
+	z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ULL;
+	z = (z ^ (z >> 27)) * 0x94d049bb133111ebULL;
+
+	return z ^ (z >> 31);
+}
+
+/* every link gets its own stream, derived from the seed and its ends */
+struct link_state *channel_link_state(int src, int dst)
+{
+	struct link_state *state = calloc(1, sizeof(*state));
+	uint64_t x = channel.seed ^ ((uint64_t)src << 32 | dst);
+	uint64_t a = splitmix64(&x), b = splitmix64(&x);
+
+	if (!state) {
+		return NULL;
+	}
+
+	state->rng[0] = a;
+	state->rng[1] = a >> 32;
+	state->rng[2] = b;
+	state->rng[3] = b >> 32;
+
+	return state;
+}
+
+void channel_free_state(struct link_state *state)
+{
+	if (state) {
+		free(state->replay);
+	}
+
+	free(state);
+}
+
+/* a new link, with the default settings where it has none */
+void channel_init_link(struct link *link, int src)
+{
+	if (link->latency_us == LINK_DEFAULT) {
+		link->latency_us = channel.latency_us;
+	}
+
+	if (link->jitter_us == LINK_DEFAULT) {
+		link->jitter_us = channel.jitter_us;
+	}
+
+	link->state = channel_link_state(src, link->dst);
+}
+
+int channel_init_links(struct topology *topology)
+{
+	for (int src = 0; src < topology->n; src++) {
+		for (int l = topology->row_ptr[src];
+		     l < topology->row_ptr[src + 1]; l++) {
+			channel_init_link(&topology->links[l], src);
+
+			if (!topology->links[l].state) {
+				return -1;
+			}
+		}
+	}
+
+	return 0;
+}
+
+void channel_free_links(struct topology *topology)
+{
+	for (int l = 0; l < topology->row_ptr[topology->n]; l++) {
+		channel_free_state(topology->links[l].state);
+	}
+}
+
+uint64_t channel_air_time(uint8_t len)
+{
+	if (!channel.bandwidth) {
+		return 0;
+	}
+
+	return (uint64_t)(len + CHANNEL_PHY_OVERHEAD) * 8 * 1000000 /
+		channel.bandwidth;
+}
+
+/* the fate of a frame in the replayed log, if there is one */
+static const struct replay_fate *replay_fate(const struct link_state *state,
+					     uint32_t seq)
+{
+	if (seq < state->replay_count && state->replay[seq].type) {
+		return &state->replay[seq];
+	}
+
+	return NULL;
+}
+
+/* Returns false if the frame sent until sent_us is lost on the link,
+ * else sets the time it has been received whole at the other end, after
+ * the propagation delay of the link. A link never reorders frames, nor
+ * does it overlap them: a frame comes in air_us after the one before it
+ * at the earliest.
+ *
+ * Frames in a replayed log meet their fate in it instead.
+ */
+bool channel_transmit(struct link *link, uint64_t sent_us, uint64_t air_us,
+		      uint64_t *due_us)
+{
+	struct link_state *state = link->state;
+	const struct replay_fate *fate = replay_fate(state, state->seq++);
+	uint64_t due;
+	float loss;
+
+	if (fate) {
+		if (fate->type == EVENT_LOST) {
+			return false;
+		}
+
+		due = sent_us + fate->delay_us;
+		goto out;
+	}
+
+	if (channel.ge_p > 0) {
+		float u = rng_float(state->rng);
+
+		if (state->bad) {
+			state->bad = u >= channel.ge_r;
+		} else {
+			state->bad = u < channel.ge_p;
+		}
+	}
+
+	loss = state->bad ? channel.ge_bad_loss : 1 - link->prob;
+	if (loss > 0 && rng_float(state->rng) < loss) {
+		return false;
+	}
+
+	due = sent_us + link->latency_us;
+
+	if (link->jitter_us) {
+		due += rng_next(state->rng) % (link->jitter_us + 1);
+	}
+
+out:
+	if (due < state->last_due + air_us) {
+		due = state->last_due + air_us;
+	}
+
+	state->last_due = due;
+	*due_us = due;
+
+	return true;
+}
+
+/* how the seq-th frame over the link was received in the replayed log,
+ * 0 to leave it to the medium
+ */
+uint8_t channel_replay_rx(const struct link *link, uint32_t seq)
+{
+	const struct replay_fate *fate = replay_fate(link->state, seq);
+
+	return fate ? fate->type : 0;
+}
@@ -0,0 +1,63 @@
+/*
+ * Copyright (c) 2018 CPqD Foundation
+ *
+ * SPDX-License-Identifier: Apache-2.0
+ */
+
+#ifndef CHANNEL_H_
+#define CHANNEL_H_
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#include "graphs.h"
+
+/* preamble, SFD and PHY header sent ahead of every PSDU */
+#define CHANNEL_PHY_OVERHEAD 6
+
+/* settings shared by all the links */
+struct channel_params {
+	uint64_t seed;		/* of the random streams of the links */
+	uint32_t latency_us;	/* propagation delay */
+	uint32_t jitter_us;	/* added at random, 0 to jitter_us */
+	uint32_t bandwidth;	/* bit/s of the radios, 0 for no air time */
+	/* Gilbert-Elliott: chance per frame of a good link turning bad
+	 * and of a bad one recovering, and the loss while bad. A good
+	 * link loses 1 - prob of the frames.
+	 */
+	float ge_p;
+	float ge_r;
+	float ge_bad_loss;
+};
+
+/* what became of a frame in a replayed log */
+struct replay_fate {
+	uint32_t delay_us;
+	uint8_t type;		/* enum event_type, 0 if not in the log */
+};
+
+/* what a link changes as frames go over it, kept across topology updates
+ * and only touched by the worker of the sending node
+ */
+struct link_state {
+	uint32_t rng[4];
+	bool bad;
+	uint64_t last_due;
+	uint32_t seq;		/* frames sent over the link */
+	struct replay_fate *replay;
+	uint32_t replay_count;
+};
+
+extern struct channel_params channel;
+
+struct link_state *channel_link_state(int src, int dst);
+void channel_free_state(struct link_state *state);
+void channel_init_link(struct link *link, int src);
+int channel_init_links(struct topology *topology);
+void channel_free_links(struct topology *topology);
+uint64_t channel_air_time(uint8_t len);
+bool channel_transmit(struct link *link, uint64_t sent_us, uint64_t air_us,
+		      uint64_t *due_us);
+uint8_t channel_replay_rx(const struct link *link, uint32_t seq);
+
+#endif
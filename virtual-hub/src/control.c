@@ -0,0 +1,534 @@
+/*
+ * Copyright (c) 2018 CPqD Foundation
+ *
+ * SPDX-License-Identifier: Apache-2.0
+ */
+
+#include <errno.h>
+#include <pthread.h>
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "channel.h"
+#include "control.h"
+
+#define MAX_TOKENS 8
+
+/* one update at a time, from the socket or from a script */
+static pthread_mutex_t control_mutex = PTHREAD_MUTEX_INITIALIZER;
+static int listen_fd = -1;
+static char *control_path;
+
+/* Link commands applied to a private copy of the topology, published at
+ * once when all of them went through. The workers keep sending over the
+ * old topology meanwhile, and the channel state of the links is shared
+ * between the two.
+ */
+struct batch {
+	struct topology *base;
+	struct topology *topology;
+	struct link_state **added;	/* freed if the batch fails */
+	struct link_state **dead;	/* freed once it is published */
+	int num_added;
+	int num_dead;
+	char *err;
+	size_t err_len;
+};
+
+struct script {
+	FILE *file;
+	char *path;
+};
+
+static int batch_error(struct batch *batch, const char *fmt, ...)
+{
+	va_list ap;
+
+	va_start(ap, fmt);
+	vsnprintf(batch->err, batch->err_len, fmt, ap);
+	va_end(ap);
+
+	return -1;
+}
+
+static int push_state(struct link_state ***states, int *count,
+		      struct link_state *state)
+{
+	struct link_state **grown = realloc(*states,
+					    (*count + 1) * sizeof(*grown));
+
+	if (!grown) {
+		return -1;
+	}
+
+	grown[(*count)++] = state;
+	*states = grown;
+
+	return 0;
+}
+
+/* node ids start at 1, as QEMU_PIPE_ID */
+static int parse_node(struct batch *batch, const char *str, int *node)
+{
+	char *end;
+	long id = strtol(str, &end, 10);
+
+	if (*end || end == str || id < 1 || id > batch->base->n) {
+		return batch_error(batch, "no node %s", str);
+	}
+
+	*node = id - 1;
+
+	return 0;
+}
+
+/* a time in us, in base 10 and short of LINK_DEFAULT */
+static int parse_us(struct batch *batch, const char *key, const char *str,
+		    uint32_t *value)
+{
+	unsigned long v;
+	char *end;
+
+	errno = 0;
+	v = strtoul(str, &end, 10);
+
+	if (*end || end == str || errno || str[0] == '-' ||
+	    v >= LINK_DEFAULT) {
+		return batch_error(batch, "bad %s %s", key, str);
+	}
+
+	*value = v;
+
+	return 0;
+}
+
+static int parse_options(struct batch *batch, char **tok, int num_tok,
+			 struct link *link)
+{
+	for (int i = 0; i < num_tok; i++) {
+		char *value = strchr(tok[i], '=');
+		char *end;
+
+		if (!value) {
+			return batch_error(batch, "expected key=value, got %s",
+					   tok[i]);
+		}
+
+		*value++ = '\0';
+
+		if (!strcmp(tok[i], "prob")) {
+			link->prob = strtof(value, &end);
+
+			if (*end || end == value) {
+				return batch_error(batch, "bad prob %s", value);
+			}
+
+			if (!(link->prob >= 0 && link->prob <= 1)) {
+				return batch_error(batch, "prob %s out of "
+						   "[0, 1]", value);
+			}
+		} else if (!strcmp(tok[i], "latency")) {
+			if (parse_us(batch, tok[i], value,
+				     &link->latency_us) < 0) {
+				return -1;
+			}
+		} else if (!strcmp(tok[i], "jitter")) {
+			if (parse_us(batch, tok[i], value,
+				     &link->jitter_us) < 0) {
+				return -1;
+			}
+		} else {
+			return batch_error(batch, "unknown setting %s", tok[i]);
+		}
+	}
+
+	return 0;
+}
+
+static int batch_edit(struct batch *batch, int src, const struct link *link,
+		      bool remove)
+{
+	struct topology *copy = topology_edit(batch->topology, src, link,
+					      remove);
+
+	if (!copy) {
+		return batch_error(batch, "out of memory");
+	}
+
+	if (batch->topology != batch->base) {
+		topology_free(batch->topology);
+	}
+	batch->topology = copy;
+
+	return 0;
+}
+
+/* link add|set|del <src> <dst> [prob=P] [latency=US] [jitter=US] */
+static int batch_command(struct batch *batch, char *cmd)
+{
+	char *tok[MAX_TOKENS], *save;
+	struct link link, *found;
+	int num_tok = 0, src, dst;
+
+	for (char *t = strtok_r(cmd, " \t\r\n", &save); t;
+	     t = strtok_r(NULL, " \t\r\n", &save)) {
+		if (num_tok == MAX_TOKENS) {
+			return batch_error(batch, "too many arguments");
+		}
+		tok[num_tok++] = t;
+	}
+
+	if (!num_tok) {
+		return 0;
+	}
+
+	if (strcmp(tok[0], "link") || num_tok < 4) {
+		return batch_error(batch, "expected link add|set|del "
+				   "<src> <dst> [settings]");
+	}
+
+	if (parse_node(batch, tok[2], &src) < 0 ||
+	    parse_node(batch, tok[3], &dst) < 0) {
+		return -1;
+	}
+
+	found = topology_find(batch->topology, src, dst);
+
+	if (!strcmp(tok[1], "add")) {
+		if (found) {
+			return batch_error(batch, "link %s %s exists", tok[2],
+					   tok[3]);
+		}
+
+		link = (struct link){
+			.dst = dst,
+			.prob = 1,
+			.latency_us = LINK_DEFAULT,
+			.jitter_us = LINK_DEFAULT,
+		};
+		channel_init_link(&link, src);
+		if (!link.state ||
+		    push_state(&batch->added, &batch->num_added,
+			       link.state) < 0) {
+			channel_free_state(link.state);
+			return batch_error(batch, "out of memory");
+		}
+
+		if (parse_options(batch, &tok[4], num_tok - 4, &link) < 0) {
+			return -1;
+		}
+
+		return batch_edit(batch, src, &link, false);
+	}
+
+	if (!found) {
+		return batch_error(batch, "no link %s %s", tok[2], tok[3]);
+	}
+
+	link = *found;
+
+	if (!strcmp(tok[1], "set")) {
+		if (parse_options(batch, &tok[4], num_tok - 4, &link) < 0) {
+			return -1;
+		}
+
+		return batch_edit(batch, src, &link, false);
+	}
+
+	if (!strcmp(tok[1], "del") && num_tok == 4) {
+		if (push_state(&batch->dead, &batch->num_dead,
+			       link.state) < 0) {
+			return batch_error(batch, "out of memory");
+		}
+
+		return batch_edit(batch, src, &link, true);
+	}
+
+	return batch_error(batch, "expected link add|set|del "
+			   "<src> <dst> [settings]");
+}
+
+/* Apply the link commands of a line, separated by ';', all or none. The
+ * old topology is freed once no worker can be sending over it.
+ */
+int control_run(char *line, char *err, size_t err_len)
+{
+	struct batch batch = { .err = err, .err_len = err_len };
+	char *cmd, *save;
+	int ret = 0;
+
+	pthread_mutex_lock(&control_mutex);
+
+	batch.base = atomic_load(&topology);
+	batch.topology = batch.base;
+
+	for (cmd = strtok_r(line, ";", &save); cmd && !ret;
+	     cmd = strtok_r(NULL, ";", &save)) {
+		ret = batch_command(&batch, cmd);
+	}
+
+	if (ret < 0) {
+		for (int i = 0; i < batch.num_added; i++) {
+			channel_free_state(batch.added[i]);
+		}
+
+		if (batch.topology != batch.base) {
+			topology_free(batch.topology);
+		}
+	} else if (batch.topology != batch.base) {
+		atomic_store(&topology, batch.topology);
+		synchronize_workers();
+		topology_free(batch.base);
+
+		for (int i = 0; i < batch.num_dead; i++) {
+			channel_free_state(batch.dead[i]);
+		}
+	}
+
+	pthread_mutex_unlock(&control_mutex);
+
+	free(batch.added);
+	free(batch.dead);
+
+	return ret;
+}
+
+static void control_show(FILE *out)
+{
+	struct topology *current;
+
+	pthread_mutex_lock(&control_mutex);
+	current = atomic_load(&topology);
+
+	for (int src = 0; src < current->n; src++) {
+		for (int l = current->row_ptr[src];
+		     l < current->row_ptr[src + 1]; l++) {
+			const struct link *link = &current->links[l];
+
+			fprintf(out, "%d %d prob=%g latency=%u jitter=%u\n",
+				src + 1, link->dst + 1, link->prob,
+				link->latency_us, link->jitter_us);
+		}
+	}
+
+	pthread_mutex_unlock(&control_mutex);
+}
+
+/* Each line of a script is a time in ms from its start and the link
+ * commands to run then, e.g. a node walking away from another:
+ *	0 link set 1 2 prob=0.9; link set 2 1 prob=0.9
+ *	5000 link set 1 2 prob=0.5; link set 2 1 prob=0.5
+ *	10000 link del 1 2; link del 2 1
+ */
+static void *script_run(void *data)
+{
+	struct script *script = data;
+	struct timespec start, at;
+	char *line = NULL, *cmd, err[128];
+	size_t size = 0;
+	int num = 0;
+
+	clock_gettime(CLOCK_MONOTONIC, &start);
+
+	while (getline(&line, &size, script->file) > 0) {
+		unsigned long ms;
+
+		num++;
+		cmd = line + strspn(line, " \t");
+		if (*cmd == '#' || *cmd == '\n' || !*cmd) {
+			continue;
+		}
+
+		ms = strtoul(cmd, &cmd, 10);
+		at.tv_sec = start.tv_sec + ms / 1000;
+		at.tv_nsec = start.tv_nsec + ms % 1000 * 1000000;
+		if (at.tv_nsec >= 1000000000) {
+			at.tv_sec++;
+			at.tv_nsec -= 1000000000;
+		}
+
+		while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &at,
+				       NULL) == EINTR) {
+		}
+
+		if (control_run(cmd, err, sizeof(err)) < 0) {
+			printf("%s:%d: %s\n", script->path, num, err);
+		}
+	}
+
+	printf("Script %s done\n", script->path);
+
+	free(line);
+	fclose(script->file);
+	free(script->path);
+	free(script);
+
+	return NULL;
+}
+
+static int control_script(const char *path, char *err, size_t err_len)
+{
+	struct script *script = calloc(1, sizeof(*script));
+	pthread_attr_t attr;
+	pthread_t thread;
+
+	if (!script) {
+		snprintf(err, err_len, "out of memory");
+		return -1;
+	}
+
+	script->file = fopen(path, "r");
+	script->path = strdup(path);
+	if (!script->file || !script->path) {
+		snprintf(err, err_len, "cannot open %s (%s)", path,
+			 strerror(errno));
+		goto fail;
+	}
+
+	pthread_attr_init(&attr);
+	pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+
+	if (pthread_create(&thread, &attr, script_run, script) != 0) {
+		snprintf(err, err_len, "cannot start the script");
+		pthread_attr_destroy(&attr);
+		goto fail;
+	}
+
+	pthread_attr_destroy(&attr);
+
+	return 0;
+
+fail:
+	if (script->file) {
+		fclose(script->file);
+	}
+	free(script->path);
+	free(script);
+
+	return -1;
+}
+
+/* a line from a client, answered with "ok" or "error: ..." */
+static void control_line(char *line, FILE *out)
+{
+	char err[512], word[16] = "", arg[256] = "";
+	int ret = 0;
+
+	sscanf(line, "%15s %255s", word, arg);
+
+	if (!strcmp(word, "show")) {
+		control_show(out);
+	} else if (!strcmp(word, "script")) {
+		ret = control_script(arg, err, sizeof(err));
+	} else {
+		ret = control_run(line, err, sizeof(err));
+	}
+
+	if (ret < 0) {
+		fprintf(out, "error: %s\n", err);
+	} else {
+		fprintf(out, "ok\n");
+	}
+
+	fflush(out);
+}
+
+/* one client at a time, a line per request */
+static void *control_thread(void *data)
+{
+	char *line = NULL;
+	size_t size = 0;
+
+	while (true) {
+		int fd = accept(listen_fd, NULL, NULL);
+		FILE *in, *out;
+
+		if (fd < 0) {
+			if (errno == EINTR || errno == ECONNABORTED) {
+				continue;
+			}
+			break;
+		}
+
+		in = fdopen(fd, "r");
+		out = fdopen(dup(fd), "w");
+
+		while (in && out && getline(&line, &size, in) > 0) {
+			control_line(line, out);
+		}
+
+		if (in) {
+			fclose(in);
+		} else {
+			close(fd);
+		}
+
+		if (out) {
+			fclose(out);
+		}
+	}
+
+	free(line);
+
+	return NULL;
+}
+
+int control_start(const char *path)
+{
+	struct sockaddr_un addr = { .sun_family = AF_UNIX };
+	pthread_t thread;
+
+	if (strlen(path) >= sizeof(addr.sun_path)) {
+		errno = ENAMETOOLONG;
+		return -1;
+	}
+
+	strcpy(addr.sun_path, path);
+	unlink(path);
+
+	listen_fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+	if (listen_fd < 0) {
+		return -1;
+	}
+
+	if (bind(listen_fd, (struct sockaddr *)&addr, sizeof(addr)) < 0 ||
+	    listen(listen_fd, 4) < 0) {
+		goto fail;
+	}
+
+	control_path = strdup(path);
+
+	if (pthread_create(&thread, NULL, control_thread, NULL) != 0) {
+		goto fail;
+	}
+
+	pthread_detach(thread);
+
+	return 0;
+
+fail:
+	close(listen_fd);
+	listen_fd = -1;
+
+	return -1;
+}
+
+/* Updates stop for good: the topology is about to be freed. */
+void control_stop(void)
+{
+	pthread_mutex_lock(&control_mutex);
+
+	if (listen_fd < 0) {
+		return;
+	}
+
+	close(listen_fd);
+	unlink(control_path);
+	free(control_path);
+}
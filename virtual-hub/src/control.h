@@ -0,0 +1,24 @@
+/*
+ * Copyright (c) 2018 CPqD Foundation
+ *
+ * SPDX-License-Identifier: Apache-2.0
+ */
+
+#ifndef CONTROL_H_
+#define CONTROL_H_
+
+#include <stdatomic.h>
+
+#include "graphs.h"
+
+/* Provided by the hub: the topology the workers send frames over, and a
+ * wait until no worker can hold a topology loaded before the call.
+ */
+extern _Atomic(struct topology *) topology;
+void synchronize_workers(void);
+
+int control_start(const char *path);
+int control_run(char *line, char *err, size_t err_len);
+void control_stop(void);
+
+#endif
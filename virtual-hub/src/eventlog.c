@@ -0,0 +1,297 @@
+/*
+ * Copyright (c) 2018 CPqD Foundation
+ *
+ * SPDX-License-Identifier: Apache-2.0
+ */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "channel.h"
+#include "eventlog.h"
+
+_Static_assert(sizeof(struct event) == 24, "event records are 24 bytes");
+
+bool eventlog_on;
+
+static int log_fd = -1;
+static pthread_mutex_t log_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+/* a mapped log, checked */
+struct eventlog_map {
+	void *map;
+	size_t size;
+	const struct eventlog_header *header;
+	const struct event *event;
+	size_t count;
+};
+
+int eventlog_open(const char *path, int nodes)
+{
+	struct eventlog_header header = {
+		.magic = EVENTLOG_MAGIC,
+		.version = EVENTLOG_VERSION,
+		.seed = channel.seed,
+		.nodes = nodes,
+		.bandwidth = channel.bandwidth,
+	};
+
+	if (nodes > EVENTLOG_MAX_NODES) {
+		printf("An event log takes at most %d nodes\n",
+		       EVENTLOG_MAX_NODES);
+		return -1;
+	}
+
+	log_fd = open(path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+	if (log_fd < 0) {
+		printf("Cannot write %s (%s)\n", path, strerror(errno));
+		return -1;
+	}
+
+	if (write(log_fd, &header, sizeof(header)) != sizeof(header)) {
+		printf("Cannot write %s (%s)\n", path, strerror(errno));
+		close(log_fd);
+		log_fd = -1;
+		return -1;
+	}
+
+	eventlog_on = true;
+
+	return 0;
+}
+
+/* whole batches go out under the lock, so the records of the workers
+ * are interleaved by batch and never torn
+ */
+void eventlog_flush(struct eventlog_buf *buf)
+{
+	if (!buf->count) {
+		return;
+	}
+
+	pthread_mutex_lock(&log_mutex);
+	if (write(log_fd, buf->event, buf->count * sizeof(struct event)) < 0) {
+		printf("Failed to write the event log (%s)\n", strerror(errno));
+	}
+	pthread_mutex_unlock(&log_mutex);
+
+	buf->count = 0;
+}
+
+void eventlog_close(void)
+{
+	if (log_fd < 0) {
+		return;
+	}
+
+	eventlog_on = false;
+	close(log_fd);
+	log_fd = -1;
+}
+
+static int eventlog_map(const char *path, struct eventlog_map *log)
+{
+	struct stat st;
+	int fd = open(path, O_RDONLY);
+
+	log->map = MAP_FAILED;
+
+	if (fd < 0 || fstat(fd, &st) < 0) {
+		printf("Cannot open %s (%s)\n", path, strerror(errno));
+		goto fail;
+	}
+
+	if ((size_t)st.st_size < sizeof(*log->header)) {
+		printf("%s is not an event log\n", path);
+		goto fail;
+	}
+
+	log->size = st.st_size;
+	log->map = mmap(NULL, log->size, PROT_READ, MAP_PRIVATE, fd, 0);
+	if (log->map == MAP_FAILED) {
+		printf("Cannot map %s (%s)\n", path, strerror(errno));
+		goto fail;
+	}
+
+	close(fd);
+
+	log->header = log->map;
+	log->event = (const struct event *)(log->header + 1);
+	log->count = (log->size - sizeof(*log->header)) / sizeof(struct event);
+
+	if (log->header->magic != EVENTLOG_MAGIC ||
+	    log->header->version != EVENTLOG_VERSION) {
+		printf("%s is not an event log of this version\n", path);
+		munmap(log->map, log->size);
+		return -1;
+	}
+
+	return 0;
+
+fail:
+	if (fd >= 0) {
+		close(fd);
+	}
+
+	return -1;
+}
+
+int eventlog_seed(const char *path, uint64_t *seed)
+{
+	struct eventlog_map log;
+
+	if (eventlog_map(path, &log) < 0) {
+		return -1;
+	}
+
+	*seed = log.header->seed;
+	munmap(log.map, log.size);
+
+	return 0;
+}
+
+/* Give each link the fate of its frames in the log, by their order on
+ * the link: the k-th frame sent over a link is lost, delayed and
+ * received as the k-th one was.
+ */
+int eventlog_replay(const char *path, struct topology *topology)
+{
+	struct eventlog_map log;
+	unsigned long missing = 0;
+	int links = topology->row_ptr[topology->n];
+
+	if (eventlog_map(path, &log) < 0) {
+		return -1;
+	}
+
+	if (log.header->nodes != (uint32_t)topology->n) {
+		printf("%s is a log of %u nodes, not %d\n", path,
+		       log.header->nodes, topology->n);
+		munmap(log.map, log.size);
+		return -1;
+	}
+
+	if (topology->n > EVENTLOG_MAX_NODES) {
+		printf("An event log takes at most %d nodes\n",
+		       EVENTLOG_MAX_NODES);
+		munmap(log.map, log.size);
+		return -1;
+	}
+
+	/* room for the highest seq of every link */
+	for (size_t i = 0; i < log.count; i++) {
+		const struct event *event = &log.event[i];
+		struct link *link = NULL;
+
+		if (event->src < topology->n && event->dst < topology->n) {
+			link = topology_find(topology, event->src, event->dst);
+		}
+
+		if (!link) {
+			missing++;
+			continue;
+		}
+
+		if (event->seq >= link->state->replay_count) {
+			link->state->replay_count = event->seq + 1;
+		}
+	}
+
+	for (int l = 0; l < links; l++) {
+		struct link_state *state = topology->links[l].state;
+
+		if (!state->replay_count) {
+			continue;
+		}
+
+		state->replay = calloc(state->replay_count,
+				       sizeof(*state->replay));
+		if (!state->replay) {
+			munmap(log.map, log.size);
+			return -1;
+		}
+	}
+
+	/* a frame still on its way when the log ended counts as received */
+	for (size_t i = 0; i < log.count; i++) {
+		const struct event *event = &log.event[i];
+		struct replay_fate *fate;
+		struct link *link = NULL;
+
+		if (event->src < topology->n && event->dst < topology->n) {
+			link = topology_find(topology, event->src, event->dst);
+		}
+
+		if (!link) {
+			continue;
+		}
+
+		fate = &link->state->replay[event->seq];
+
+		if (event->type == EVENT_SENT) {
+			fate->delay_us = event->delay_us;
+			if (!fate->type) {
+				fate->type = EVENT_RX;
+			}
+		} else {
+			fate->type = event->type;
+		}
+	}
+
+	printf("Replaying %zu events from %s\n", log.count, path);
+	if (missing) {
+		printf("%lu events are for links not in the topology\n",
+		       missing);
+	}
+
+	munmap(log.map, log.size);
+
+	return 0;
+}
+
+int eventlog_print(const char *path)
+{
+	static const char *const name[] = {
+		[EVENT_SENT] = "sent",
+		[EVENT_LOST] = "lost",
+		[EVENT_RX] = "received",
+		[EVENT_COLLIDED] = "collided",
+	};
+	struct eventlog_map log;
+
+	if (eventlog_map(path, &log) < 0) {
+		return -1;
+	}
+
+	printf("# seed %llu, %u nodes, %u bit/s\n",
+	       (unsigned long long) log.header->seed, log.header->nodes,
+	       log.header->bandwidth);
+
+	for (size_t i = 0; i < log.count; i++) {
+		const struct event *event = &log.event[i];
+
+		printf("%llu.%06llu %d %d %u %s len %u",
+		       (unsigned long long) event->time_us / 1000000,
+		       (unsigned long long) event->time_us % 1000000,
+		       event->src + 1, event->dst + 1, event->seq,
+		       event->type <= EVENT_COLLIDED && name[event->type] ?
+		       name[event->type] : "?", event->len);
+
+		if (event->type == EVENT_SENT) {
+			printf(" delay %u", event->delay_us);
+		}
+
+		printf("\n");
+	}
+
+	munmap(log.map, log.size);
+
+	return 0;
+}
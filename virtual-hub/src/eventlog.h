@@ -0,0 +1,92 @@
+/*
+ * Copyright (c) 2018 CPqD Foundation
+ *
+ * SPDX-License-Identifier: Apache-2.0
+ */
+
+#ifndef EVENTLOG_H_
+#define EVENTLOG_H_
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#include "graphs.h"
+
+#define EVENTLOG_MAGIC 0x42554856	/* "VHUB" */
+#define EVENTLOG_VERSION 1
+
+/* node ids are 16 bits in the records */
+#define EVENTLOG_MAX_NODES UINT16_MAX
+
+/* events written per worker at once */
+#define EVENTLOG_BATCH 256
+
+struct eventlog_header {
+	uint32_t magic;
+	uint32_t version;
+	uint64_t seed;
+	uint32_t nodes;
+	uint32_t bandwidth;
+};
+
+/* what happened to the seq-th frame sent from src to dst */
+enum event_type {
+	EVENT_SENT = 1,		/* on its way, due delay_us after sent */
+	EVENT_LOST,		/* on the link */
+	EVENT_RX,		/* written to the receiver */
+	EVENT_COLLIDED,		/* lost on the air at the receiver */
+};
+
+struct event {
+	uint64_t time_us;	/* since the hub started */
+	uint32_t seq;
+	uint32_t delay_us;
+	uint16_t src;
+	uint16_t dst;
+	uint8_t type;
+	uint8_t len;
+	uint16_t reserved;
+};
+
+/* filled by one worker, written out when full and before it waits */
+struct eventlog_buf {
+	unsigned int count;
+	struct event event[EVENTLOG_BATCH];
+};
+
+extern bool eventlog_on;
+
+int eventlog_open(const char *path, int nodes);
+void eventlog_flush(struct eventlog_buf *buf);
+void eventlog_close(void);
+int eventlog_seed(const char *path, uint64_t *seed);
+int eventlog_replay(const char *path, struct topology *topology);
+int eventlog_print(const char *path);
+
+static inline void eventlog_add(struct eventlog_buf *buf, uint8_t type,
+				uint64_t time_us, int src, int dst,
+				uint32_t seq, uint32_t delay_us, uint8_t len)
+{
+	struct event *event;
+
+	if (!eventlog_on) {
+		return;
+	}
+
+	event = &buf->event[buf->count++];
+	*event = (struct event){
+		.time_us = time_us,
+		.seq = seq,
+		.delay_us = delay_us,
+		.src = src,
+		.dst = dst,
+		.type = type,
+		.len = len,
+	};
+
+	if (buf->count == EVENTLOG_BATCH) {
+		eventlog_flush(buf);
+	}
+}
+
+#endif
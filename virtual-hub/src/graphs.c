@@ -4,93 +4,544 @@
  * SPDX-License-Identifier: Apache-2.0
  */
 
+#include <ctype.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <stdarg.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
-#include <time.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
 
-/* generate random numbers for the nodes */
-float random_nodes(void)
+#include "graphs.h"
+
+/* The file is mapped and read once, front to back: numbers are parsed in
+ * place, as strtod() would need them NUL terminated.
+ */
+struct loader {
+	const char *path;
+	const char *p;
+	const char *end;
+	int line;
+	struct link *links;
+	int count;
+	int size;
+};
+
+/* links in file order, each with the sending node in src */
+struct edge {
+	int src;
+	struct link link;
+};
+
+static void *load_error(struct loader *loader, const char *fmt, ...)
 {
-	float random_number = ((float)rand()) / ((float)RAND_MAX);
-	return random_number;
+	va_list ap;
+
+	printf("%s:%d: ", loader->path, loader->line);
+	va_start(ap, fmt);
+	vprintf(fmt, ap);
+	va_end(ap);
+	printf("\n");
+
+	return NULL;
 }
 
-/* free the memory */
-void free_memory(float **m, int length)
+static void skip_blanks(struct loader *loader)
 {
-	for (int i = 0; i < length; i++) {
-		free(m[i]);
+	while (loader->p < loader->end &&
+	       (*loader->p == ' ' || *loader->p == '\t' ||
+		*loader->p == '\r')) {
+		loader->p++;
 	}
-	free(m);
 }
 
-/* create a dinamic matrix */
-float **create_matrix(int n)
+/* skip empty lines, returns false at the end of the file */
+static bool next_line(struct loader *loader)
 {
-	float **matrix = (float **)malloc(n * sizeof(float *));
+	while (skip_blanks(loader), loader->p < loader->end &&
+	       *loader->p == '\n') {
+		loader->p++;
+		loader->line++;
+	}
 
-	for (int i = 0; i < n; i++) {
-		matrix[i] = (float *)malloc(n * sizeof(float));
-		for (int j = 0; j < n; j++) {
-			matrix[i][j] = 0.0;
-		}
+	return loader->p < loader->end;
+}
+
+/* Returns the separator after a field, ',' or '\n', '\0' at the end of
+ * the file, or -1 for anything else.
+ */
+static int next_field(struct loader *loader)
+{
+	skip_blanks(loader);
+
+	if (loader->p == loader->end) {
+		return '\0';
+	}
+
+	if (*loader->p == ',' || *loader->p == '\n') {
+		return *loader->p++;
 	}
 
-	return matrix;
+	return -1;
 }
 
-/* read the number of lines of .csv files */
-int read_lines(char *file)
+/* decimal, with an optional fraction and exponent */
+static bool parse_number(struct loader *loader, double *value)
 {
-	FILE *fd;
-	int lines = 0;
-	char c;
+	const char *p, *end = loader->end;
+	double mantissa = 0, sign = 1, scale = 1;
+	int exponent = 0, digits = 0;
+
+	skip_blanks(loader);
+	p = loader->p;
+
+	if (p < end && (*p == '+' || *p == '-')) {
+		sign = *p++ == '-' ? -1 : 1;
+	}
+
+	for (; p < end && isdigit((unsigned char)*p); p++, digits++) {
+		mantissa = mantissa * 10 + (*p - '0');
+	}
 
-	fd = fopen(file, "r");
+	if (p < end && *p == '.') {
+		for (p++; p < end && isdigit((unsigned char)*p);
+		     p++, digits++) {
+			mantissa = mantissa * 10 + (*p - '0');
+			exponent--;
+		}
+	}
+
+	if (!digits) {
+		return false;
+	}
+
+	if (p < end && (*p == 'e' || *p == 'E')) {
+		int exp_sign = 1, exp = 0;
+		const char *q = p + 1;
 
-	while ((c = getc(fd)) != '\n') {
-		if (c == ',') {
-			lines++;
+		if (q < end && (*q == '+' || *q == '-')) {
+			exp_sign = *q++ == '-' ? -1 : 1;
+		}
+
+		if (q < end && isdigit((unsigned char)*q)) {
+			for (; q < end && isdigit((unsigned char)*q); q++) {
+				if (exp < 10000) {
+					exp = exp * 10 + (*q - '0');
+				}
+			}
+
+			exponent += exp_sign * exp;
+			p = q;
 		}
 	}
-	lines++;
-	return lines;
+
+	/* powers of ten are exact up to 1e22, one rounding for the usual
+	 * values
+	 */
+	for (int i = 0; i < abs(exponent) && scale < 1e300; i++) {
+		scale *= 10;
+	}
+
+	*value = sign * (exponent < 0 ? mantissa / scale : mantissa * scale);
+	loader->p = p;
+
+	return true;
 }
 
-/* print the matrix */
-void print_matrix(float **m, int n)
+static bool add_link(struct loader *loader, const struct link *link)
 {
-	for (int i = 0; i < n; i++) {
-		for (int j = 0; j < n; j++) {
-			printf(" %1.2f ", m[i][j]);
+	if (loader->count == loader->size) {
+		int size = loader->size ? loader->size * 2 : 256;
+		struct link *links = realloc(loader->links,
+					     size * sizeof(*links));
+
+		if (!links) {
+			return false;
 		}
-		printf("\n");
+
+		loader->links = links;
+		loader->size = size;
 	}
+
+	loader->links[loader->count++] = *link;
+
+	return true;
 }
 
-/* read .csv files containing only float contents */
-float **read_csv(char *file)
+static const char *describe(struct loader *loader)
 {
-	int file_lines = read_lines(file);
-	FILE *fd;
-	float **m = create_matrix(file_lines);
-	int lines = 0, cols = 0;
-	float num;
-
-	fd = fopen(file, "r");
-
-	while (fscanf(fd, "%f", &m[lines][cols++]) != EOF) {
-		char separator = getc(fd);
-
-		if (separator == '\n') {
-			lines++;
-			cols = 0;
-		} else if (separator != ',') {
-			printf("Unexpected char received: %c\n", separator);
+	static char c[2];
+
+	if (*loader->p == '\n') {
+		return "end of line";
+	}
+
+	c[0] = *loader->p;
+
+	return c;
+}
+
+/* A row of delivery probabilities per sending node, as many as there
+ * are columns. Only the links that can carry a frame are kept, in
+ * sparse rows built as the file is read.
+ */
+static struct topology *load_matrix(struct loader *loader,
+				    struct topology *topology)
+{
+	struct link link = {
+		.latency_us = LINK_DEFAULT,
+		.jitter_us = LINK_DEFAULT,
+	};
+	int n = 0, row = 0, col, sep;
+	double prob;
+
+	while (next_line(loader)) {
+		if (topology->row_ptr && row == n) {
+			return load_error(loader, "more than %d rows", n);
+		}
+
+		col = 0;
+
+		do {
+			if (!parse_number(loader, &prob)) {
+				return load_error(loader, "expected a "
+						  "probability at column %d",
+						  col + 1);
+			}
+
+			if (prob < 0 || prob > 1) {
+				return load_error(loader, "probability %g out "
+						  "of [0, 1]", prob);
+			}
+
+			if (topology->row_ptr && col >= n) {
+				return load_error(loader, "more than %d "
+						  "columns", n);
+			}
+
+			link.dst = col++;
+			link.prob = prob;
+			if (prob > 0 && !add_link(loader, &link)) {
+				return load_error(loader, "out of memory");
+			}
+
+			sep = next_field(loader);
+		} while (sep == ',');
+
+		if (sep < 0) {
+			return load_error(loader, "unexpected %s",
+					  describe(loader));
+		}
+
+		/* the first row gives the number of nodes */
+		if (!topology->row_ptr) {
+			n = col;
+			topology->row_ptr = calloc(n + 1, sizeof(int));
+			if (!topology->row_ptr) {
+				return load_error(loader, "out of memory");
+			}
+		} else if (col != n) {
+			return load_error(loader, "%d columns, expected %d",
+					  col, n);
+		}
+
+		topology->row_ptr[++row] = loader->count;
+		loader->line++;
+	}
+
+	if (row != n || !n) {
+		return load_error(loader, "%d rows for %d columns", row, n);
+	}
+
+	topology->n = n;
+
+	return topology;
+}
+
+static int compare_edges(const void *a, const void *b)
+{
+	const struct edge *x = a, *y = b;
+
+	if (x->src != y->src) {
+		return x->src - y->src;
+	}
+
+	return x->link.dst - y->link.dst;
+}
+
+static bool parse_id(struct loader *loader, int *id)
+{
+	double value;
+
+	if (!parse_number(loader, &value) || value < 1 || value > 1 << 20 ||
+	    value != (int)value) {
+		return false;
+	}
+
+	*id = value;
+
+	return true;
+}
+
+/* After a header line, a link per line: src,dst,prob[,delay], node ids
+ * from 1 and the delay in us. There are as many nodes as the highest id.
+ */
+static struct topology *load_edges(struct loader *loader,
+				   struct topology *topology)
+{
+	struct edge *edges = NULL, edge;
+	int count = 0, size = 0, n = 0, sep;
+	bool sorted = true;
+	double value;
+
+	/* the header */
+	while (loader->p < loader->end && *loader->p++ != '\n') {
+	}
+	loader->line++;
+
+	while (next_line(loader)) {
+		edge.link.latency_us = LINK_DEFAULT;
+		edge.link.jitter_us = LINK_DEFAULT;
+
+		if (!parse_id(loader, &edge.src) || next_field(loader) != ',' ||
+		    !parse_id(loader, &edge.link.dst) ||
+		    next_field(loader) != ',') {
+			free(edges);
+			return load_error(loader, "expected src,dst,prob"
+					  "[,delay] with node ids from 1");
+		}
+
+		if (!parse_number(loader, &value) || value < 0 || value > 1) {
+			free(edges);
+			return load_error(loader, "expected a probability in "
+					  "[0, 1]");
+		}
+		edge.link.prob = value;
+
+		sep = next_field(loader);
+		if (sep == ',') {
+			if (!parse_number(loader, &value) || value < 0 ||
+			    value >= LINK_DEFAULT) {
+				free(edges);
+				return load_error(loader, "expected a delay "
+						  "in us");
+			}
+
+			edge.link.latency_us = value;
+			sep = next_field(loader);
+		}
+
+		if (sep < 0) {
+			free(edges);
+			return load_error(loader, "unexpected %s",
+					  describe(loader));
+		}
+
+		if (edge.src > n) {
+			n = edge.src;
+		}
+		if (edge.link.dst > n) {
+			n = edge.link.dst;
+		}
+		edge.src--;
+		edge.link.dst--;
+
+		if (edge.link.prob > 0) {
+			if (count == size) {
+				struct edge *grown;
+
+				size = size ? size * 2 : 256;
+				grown = realloc(edges, size * sizeof(*edges));
+				if (!grown) {
+					free(edges);
+					return load_error(loader,
+							  "out of memory");
+				}
+				edges = grown;
+			}
+
+			if (count &&
+			    compare_edges(&edges[count - 1], &edge) > 0) {
+				sorted = false;
+			}
+
+			edges[count++] = edge;
+		}
+
+		loader->line++;
+	}
+
+	if (!n) {
+		return load_error(loader, "no links");
+	}
+
+	/* generated lists usually come sorted already */
+	if (!sorted) {
+		qsort(edges, count, sizeof(*edges), compare_edges);
+	}
+
+	topology->n = n;
+	topology->row_ptr = calloc(n + 1, sizeof(int));
+	loader->links = malloc((count + 1) * sizeof(struct link));
+	if (!topology->row_ptr || !loader->links) {
+		free(edges);
+		return load_error(loader, "out of memory");
+	}
+
+	for (int i = 0; i < count; i++) {
+		if (i && !compare_edges(&edges[i - 1], &edges[i])) {
+			printf("%s: link %d %d listed twice\n", loader->path,
+			       edges[i].src + 1, edges[i].link.dst + 1);
+			free(edges);
 			return NULL;
 		}
+
+		topology->row_ptr[edges[i].src + 1]++;
+		loader->links[i] = edges[i].link;
+	}
+
+	for (int i = 0; i < n; i++) {
+		topology->row_ptr[i + 1] += topology->row_ptr[i];
+	}
+
+	free(edges);
+
+	return topology;
+}
+
+/* a matrix, or an edge list if the first line is a header */
+struct topology *topology_load(const char *path)
+{
+	struct topology *topology = calloc(1, sizeof(*topology));
+	struct loader loader = { .path = path, .line = 1 };
+	struct topology *loaded = NULL;
+	struct stat st;
+	void *map;
+	int fd;
+
+	if (!topology) {
+		return NULL;
+	}
+
+	fd = open(path, O_RDONLY);
+	if (fd < 0 || fstat(fd, &st) < 0) {
+		printf("Cannot open %s (%s)\n", path, strerror(errno));
+		goto out;
+	}
+
+	if (!st.st_size) {
+		printf("%s is empty\n", path);
+		goto out;
 	}
-	fclose(fd);
-	return m;
+
+	map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+	if (map == MAP_FAILED) {
+		printf("Cannot map %s (%s)\n", path, strerror(errno));
+		goto out;
+	}
+
+	madvise(map, st.st_size, MADV_SEQUENTIAL);
+	loader.p = map;
+	loader.end = loader.p + st.st_size;
+
+	if (next_line(&loader) && isalpha((unsigned char)*loader.p)) {
+		loaded = load_edges(&loader, topology);
+	} else {
+		loaded = load_matrix(&loader, topology);
+	}
+
+	munmap(map, st.st_size);
+
+out:
+	if (fd >= 0) {
+		close(fd);
+	}
+
+	if (!loaded) {
+		free(loader.links);
+		topology->links = NULL;
+		topology_free(topology);
+		return NULL;
+	}
+
+	topology->links = loader.links ? loader.links :
+		calloc(1, sizeof(struct link));
+
+	return topology;
+}
+
+struct link *topology_find(const struct topology *topology, int src, int dst)
+{
+	int lo = topology->row_ptr[src], hi = topology->row_ptr[src + 1];
+
+	while (lo < hi) {
+		int mid = (lo + hi) / 2;
+
+		if (topology->links[mid].dst == dst) {
+			return &topology->links[mid];
+		}
+
+		if (topology->links[mid].dst < dst) {
+			lo = mid + 1;
+		} else {
+			hi = mid;
+		}
+	}
+
+	return NULL;
+}
+
+/* copy of the topology with the link from src to link->dst put in, in
+ * place of the one there if any, or taken out if remove
+ */
+struct topology *topology_edit(const struct topology *topology, int src,
+			       const struct link *link, bool remove)
+{
+	struct topology *copy = malloc(sizeof(*copy));
+	int n = topology->n, count = topology->row_ptr[n];
+	int i = topology->row_ptr[src], end = topology->row_ptr[src + 1];
+	int found, delta;
+
+	if (!copy) {
+		return NULL;
+	}
+
+	while (i < end && topology->links[i].dst < link->dst) {
+		i++;
+	}
+
+	found = i < end && topology->links[i].dst == link->dst;
+	delta = remove ? -found : !found;
+
+	copy->n = n;
+	copy->row_ptr = malloc((n + 1) * sizeof(int));
+	copy->links = calloc(count + delta + 1, sizeof(struct link));
+	if (!copy->row_ptr || !copy->links) {
+		topology_free(copy);
+		return NULL;
+	}
+
+	for (int k = 0; k <= n; k++) {
+		copy->row_ptr[k] = topology->row_ptr[k] + (k > src ? delta : 0);
+	}
+
+	memcpy(copy->links, topology->links, i * sizeof(struct link));
+	if (!remove) {
+		copy->links[i] = *link;
+	}
+	memcpy(&copy->links[i + !remove], &topology->links[i + found],
+	       (count - i - found) * sizeof(struct link));
+
+	return copy;
+}
+
+/* the channel state of the links is freed apart, see channel.c */
+void topology_free(struct topology *topology)
+{
+	free(topology->row_ptr);
+	free(topology->links);
+	free(topology);
 }
@@ -7,11 +7,37 @@
 #ifndef GRAPH_H_
 #define GRAPH_H_
 
-float random_nodes(void);
-void free_memory(float **m, int length);
-float **create_matrix(int n);
-int read_lines(char *file);
-void print_matrix(float **m, int n);
-float **read_csv(char *file);
+#include <stdbool.h>
+#include <stdint.h>
+
+struct link_state;
+
+/* latency or jitter left to the command line default */
+#define LINK_DEFAULT UINT32_MAX
+
+/* link from a node to one of its neighbours */
+struct link {
+	int dst;
+	float prob;	/* of a frame getting through */
+	uint32_t latency_us;
+	uint32_t jitter_us;	/* see channel.c */
+	struct link_state *state;
+};
+
+/* compressed sparse rows: the links from node i are
+ * links[row_ptr[i]] to links[row_ptr[i + 1] - 1], sorted by dst. Never
+ * changed once in use: an update makes a new copy.
+ */
+struct topology {
+	int n;
+	int *row_ptr;
+	struct link *links;
+};
+
+struct topology *topology_load(const char *path);
+struct link *topology_find(const struct topology *topology, int src, int dst);
+struct topology *topology_edit(const struct topology *topology, int src,
+			       const struct link *link, bool remove);
+void topology_free(struct topology *topology);
 
 #endif
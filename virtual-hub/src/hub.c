@@ -8,252 +8,579 @@
 #include <errno.h>
 #include <fcntl.h>
 #include <glib.h>
+#include <limits.h>
 #include <linux/if_ether.h>
 #include <pcap/pcap.h>
 #include <pthread.h>
-#include <semaphore.h>
 #include <signal.h>
 #include <stdarg.h>
+#include <stdatomic.h>
 #include <stdbool.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
 #include <sys/signalfd.h>
 #include <sys/time.h>
+#include <sys/timerfd.h>
 #include <sys/uio.h>
 #include <syslog.h>
+#include <time.h>
 #include <unistd.h>
 
+#include "channel.h"
+#include "control.h"
+#include "eventlog.h"
+#include "frame_parser.h"
 #include "graphs.h"
+#include "medium.h"
+#include "mpsc.h"
+#include "ring.h"
+#include "wheel.h"
 
 #define PIPE_IN ".in"
 #define PIPE_OUT ".out"
 
-#define PACKET_START 0
-#define FRAME_SIZE 1
-#define PACKET_PSDU 2
+/* bytes read from a node per wakeup */
+#define READ_SIZE 4096
+
+#define MAX_EVENTS 16
+/* epoll tags of a worker's eventfd and timerfd, the nodes are tagged
+ * with their index
+ */
+#define WAKE_EVENT UINT32_MAX
+#define TIMER_EVENT (UINT32_MAX - 1)
+
+/* deliveries allocated at once when a worker's pool runs dry */
+#define POOL_CHUNK 256
 
-static GMainLoop *main_loop;
 static char **pipe_in;
 static char **pipe_out;
 static int *fd_in;
+static int *fd_out;
 static int fdSize;
-unsigned char **buffer;
 int number_nodes;
-float **m;
+/* swapped by the control thread, see synchronize_workers() */
+_Atomic(struct topology *) topology;
+
+struct frame_parser *parser;
 
-/*semaphore variables */
-sem_t *sem;
-int *buffer_index;
-int *packet_state;
-int *packet_index;
-int *packet_len;
-bool **send;
-float channel_statistic_send;
+/* frame queues of the nodes, served round robin by their worker */
+struct ring *rings;
+
+/* frame on its way to a receiver, handed over to the worker that owns
+ * the receiver and held in its wheel until due
+ */
+struct delivery {
+	struct mpsc_node node;
+	struct wheel_timer timer;	/* due at the end of the frame */
+	uint64_t rx_start;
+	bool lost;
+	uint8_t replay;		/* fate in the replayed log, 0 if none */
+	int home;		/* worker whose pool it belongs to */
+	int src;
+	int dst;
+	uint32_t seq;		/* on the link */
+	uint8_t len;
+	uint8_t psdu[FRAME_MAX];
+};
+
+#define delivery_of(t) \
+	((struct delivery *)((char *)(t) - offsetof(struct delivery, timer)))
+
+/* node pos belongs to worker pos % num_workers, which alone reads its
+ * .out pipe, sends its frames on the medium and writes its .in pipe
+ */
+struct worker {
+	int id;
+	pthread_t thread;
+	int epoll_fd;
+	int wake_fd;
+	int timer_fd;
+	struct mpsc inbox;	/* frames from the other workers */
+	bool *wake;		/* workers that got frames this round */
+	struct wheel wheel;	/* frames not due yet */
+	uint64_t armed;		/* timer_fd expiry, 0 if not armed */
+	struct wheel_timer *pool;	/* free deliveries */
+	struct mpsc returns;	/* of its pool, freed by the other workers */
+	atomic_bool idle;	/* waiting for events or not running, holds
+				 * no topology
+				 */
+	atomic_ulong passes;	/* times round the loop */
+	struct eventlog_buf log;
+};
+
+static struct worker *workers;
+static int num_workers = 1;
+static atomic_bool stop;
+/* time 0 of the event log */
+static uint64_t start_us;
 
 /* allocate size for arrays */
 void alloc_size(void)
 {
 	fd_in = malloc(number_nodes * sizeof(int));
-	buffer_index = malloc(number_nodes * sizeof(int));
-	packet_state = malloc(number_nodes * sizeof(int));
-	packet_index = malloc(number_nodes * sizeof(int));
-	packet_len = malloc(number_nodes * sizeof(int));
+	fd_out = malloc(number_nodes * sizeof(int));
+	parser = malloc(number_nodes * sizeof(struct frame_parser));
+	rings = aligned_alloc(_Alignof(struct ring),
+			      number_nodes * sizeof(struct ring));
+	memset(rings, 0, number_nodes * sizeof(struct ring));
+
+	pipe_in = (char **) calloc(number_nodes, sizeof(char *));
+	pipe_out = (char **) calloc(number_nodes, sizeof(char *));
+}
 
-	buffer = (unsigned char **) malloc(
-		number_nodes * sizeof(unsigned char *));
+/* free space */
+void dealloc_size(void)
+{
+	free(fd_in);
+	free(fd_out);
+	free(parser);
+	free(rings);
 
-	for (int lines = 0; lines < number_nodes; lines++) {
-		buffer[lines] = (unsigned char *) malloc(
-			10000 * sizeof(unsigned char));
+	for (int i = 0; i < number_nodes; i++) {
+		g_free(pipe_in[i]);
+		g_free(pipe_out[i]);
 	}
+	free(pipe_in);
+	free(pipe_out);
+}
+
+static struct worker *worker_of(int pos)
+{
+	return &workers[pos % num_workers];
+}
+
+static uint64_t now_us(void)
+{
+	struct timespec ts;
 
-	send = (bool **) malloc(number_nodes * sizeof(bool *));
-	for (int lines = 0; lines < number_nodes; lines++) {
-		send[lines] = (bool *) malloc(number_nodes * sizeof(bool));
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+
+	return (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+/* single write per frame. The .in pipes do not block: a node that does
+ * not keep up loses the frame, as it would on the air.
+ */
+static void write_frame(int dst, const uint8_t *psdu, uint8_t len)
+{
+	uint8_t hdr[2] = { FRAME_START, len };
+	struct iovec iov[2] = {
+		{ .iov_base = hdr, .iov_len = sizeof(hdr) },
+		{ .iov_base = (void *)psdu, .iov_len = len },
+	};
+
+	writev(fd_in[dst], iov, 2);
+}
+
+/* Deliveries never go back to malloc: each belongs to the pool of the
+ * worker that allocated it, where the frames it sends take them from.
+ * Only the pool's owner touches it, the other workers hand the deliveries
+ * they are done with back through its returns queue.
+ */
+static void delivery_reclaim(struct worker *worker)
+{
+	struct mpsc_node *node;
+
+	while ((node = mpsc_pop(&worker->returns))) {
+		struct delivery *delivery = (struct delivery *)node;
+
+		delivery->timer.next = worker->pool;
+		worker->pool = &delivery->timer;
 	}
+}
+
+static struct delivery *delivery_alloc(struct worker *worker)
+{
+	struct delivery *chunk;
 
-	pipe_in = (char **) malloc(number_nodes * sizeof(char *));
-	pipe_out = (char **) malloc(number_nodes * sizeof(char *));
-	for (int lines = 0; lines < number_nodes; lines++) {
-		pipe_in[lines] = (char *) malloc(40 * sizeof(char));
-		pipe_out[lines] = (char *) malloc(40 * sizeof(char));
+	if (!worker->pool) {
+		delivery_reclaim(worker);
 	}
+
+	if (!worker->pool) {
+		chunk = malloc(POOL_CHUNK * sizeof(*chunk));
+		if (!chunk) {
+			return NULL;
+		}
+
+		for (int i = 0; i < POOL_CHUNK; i++) {
+			chunk[i].home = worker->id;
+			chunk[i].timer.next = i + 1 < POOL_CHUNK ?
+				&chunk[i + 1].timer : NULL;
+		}
+
+		worker->pool = &chunk[0].timer;
+	}
+
+	chunk = delivery_of(worker->pool);
+	worker->pool = worker->pool->next;
+
+	return chunk;
 }
 
-/* free space */
-void dealloc_size(void)
+static void delivery_free(struct worker *worker, struct delivery *delivery)
 {
-	free(fd_in);
-	free(buffer_index);
-	free(packet_state);
-	free(packet_index);
-	free(packet_len);
+	if (delivery->home != worker->id) {
+		mpsc_push(&workers[delivery->home].returns, &delivery->node);
+		return;
+	}
 
-	for (int i = 0; i < number_nodes; i++) {
-		free(buffer[i]);
-		free(send[i]);
-		free(pipe_in[i]);
-		free(pipe_out[i]);
+	delivery->timer.next = worker->pool;
+	worker->pool = &delivery->timer;
+}
+
+/* a frame due later, or for a node of another worker */
+static void post_frame(struct worker *worker, int src,
+		       const struct link *link, uint32_t seq,
+		       const struct ring_frame *frame, uint64_t start,
+		       uint64_t due)
+{
+	int dst = link->dst;
+	struct worker *owner = worker_of(dst);
+	struct delivery *delivery = delivery_alloc(worker);
+
+	if (!delivery) {
+		return;
 	}
-	free(buffer);
-	free(send);
-	free(pipe_in);
-	free(pipe_out);
+
+	delivery->src = src;
+	delivery->dst = dst;
+	delivery->seq = seq;
+	delivery->len = frame->len;
+	delivery->rx_start = start;
+	delivery->lost = false;
+	delivery->replay = channel_replay_rx(link, seq);
+	delivery->timer.due = due;
+	memcpy(delivery->psdu, frame->psdu, frame->len);
+
+	if (owner == worker) {
+		medium_receive(dst, start, due, &delivery->lost);
+		wheel_add(&worker->wheel, &delivery->timer);
+		return;
+	}
+
+	mpsc_push(&owner->inbox, &delivery->node);
+	worker->wake[owner->id] = true;
 }
 
-void setup_reachable_nodes(int pos)
+/* put one frame of pos on the air and send it over its links, each of
+ * which loses and delays it on its own
+ */
+void transmit_frame(struct worker *worker, int pos,
+		    const struct ring_frame *frame)
 {
-	/*set randomly probability to send the packet */
-	channel_statistic_send = random_nodes();
+	struct topology *current = atomic_load(&topology);
+	struct link *link = &current->links[current->row_ptr[pos]];
+	struct link *end = &current->links[current->row_ptr[pos + 1]];
+	uint64_t now = now_us();
+	uint64_t sent = medium_transmit(pos, now, frame->len);
+	uint64_t air = channel_air_time(frame->len);
+	uint64_t due;
+
+	for (; link < end; link++) {
+		uint32_t seq = link->state->seq;
+		uint8_t type = EVENT_RX;
+
+		if (!channel_transmit(link, sent, air, &due)) {
+			eventlog_add(&worker->log, EVENT_LOST, now - start_us,
+				     pos, link->dst, seq, 0, frame->len);
+			continue;
+		}
 
-	for (int i = 0; i < number_nodes; i++) {
-		if (m[pos][i] > channel_statistic_send) {
-			send[pos][i] = TRUE;
+		eventlog_add(&worker->log, EVENT_SENT, now - start_us, pos,
+			     link->dst, seq, due - sent, frame->len);
+
+		if (due > now || worker_of(link->dst) != worker) {
+			post_frame(worker, pos, link, seq, frame, due - air,
+				   due);
+			continue;
+		}
+
+		if (channel_replay_rx(link, seq) == EVENT_COLLIDED) {
+			type = EVENT_COLLIDED;
+		} else {
+			write_frame(link->dst, frame->psdu, frame->len);
 		}
+
+		eventlog_add(&worker->log, type, now - start_us, pos,
+			     link->dst, seq, 0, frame->len);
 	}
 }
 
-void reset_reachable_nodes(int pos)
+/* one eventfd write per worker that was posted frames, after the pushes
+ * are complete
+ */
+static void wake_workers(struct worker *worker)
 {
-	for (int i = 0; i < number_nodes; i++) {
-		send[pos][i] = FALSE;
+	uint64_t one = 1;
+
+	for (int i = 0; i < num_workers; i++) {
+		if (worker->wake[i]) {
+			worker->wake[i] = false;
+			write(workers[i].wake_fd, &one, sizeof(one));
+		}
 	}
 }
 
-void broadcast_data(int pos, unsigned char *buf)
+/* one frame per node and round, in node order, until the queues of the
+ * worker's nodes are empty: a busy node delays the others by no more
+ * than a frame
+ */
+static void schedule(struct worker *worker)
 {
-	for (int i = 0; i < fdSize; i++) {
-		if (send[pos][i] == TRUE) {
-			write(fd_in[i], buf, 1);
+	struct ring_frame *frame;
+	bool idle = false;
+
+	while (!idle) {
+		idle = true;
+
+		for (int pos = worker->id; pos < number_nodes;
+		     pos += num_workers) {
+			frame = ring_peek(&rings[pos]);
+			if (!frame) {
+				continue;
+			}
+
+			transmit_frame(worker, pos, frame);
+			ring_pop(&rings[pos]);
+			idle = false;
 		}
 	}
+
+	wake_workers(worker);
 }
 
-static gboolean fifo_handler(GIOChannel *channel,
-			     GIOCondition cond,
-			     gpointer user_data)
+/* queue a frame read from node pos. The worker reading pos is also the
+ * one serving its queue, so a full queue is made room in by sending.
+ */
+void queue_frame(const uint8_t *psdu, size_t len, void *user_data)
 {
-	unsigned char buf[1];
-	ssize_t result;
-	int fd;
 	int pos = GPOINTER_TO_INT(user_data);
+	struct ring_frame *frame;
 
-	if (cond & (G_IO_NVAL | G_IO_ERR | G_IO_HUP)) {
-		printf("Pipe closed");
-		return FALSE;
+	while (!(frame = ring_reserve(&rings[pos]))) {
+		schedule(worker_of(pos));
 	}
 
-	memset(buf, 0, sizeof(buf));
-	fd = g_io_channel_unix_get_fd(channel);
+	frame->len = len;
+	memcpy(frame->psdu, psdu, len);
+	ring_push(&rings[pos]);
+}
+
+/* A frame lost to a collision is dropped only now that it is over. In
+ * a replay it is lost or not as it was in the log.
+ */
+static void deliver(struct worker *worker, struct delivery *delivery)
+{
+	bool lost;
 
-	result = read(fd, buf, 1);
+	medium_release(delivery->dst, delivery->rx_start, &delivery->lost);
+
+	if (delivery->replay) {
+		lost = delivery->replay == EVENT_COLLIDED;
+	} else {
+		lost = delivery->lost;
+	}
 
-	if (result != 1) {
-		printf("Failed to read %lu", result);
-		return FALSE;
+	if (!lost) {
+		write_frame(delivery->dst, delivery->psdu, delivery->len);
 	}
 
-	if (packet_state[pos] == PACKET_START) {
-		int ret = sem_trywait(sem);
+	eventlog_add(&worker->log, lost ? EVENT_COLLIDED : EVENT_RX,
+		     delivery->timer.due - start_us, delivery->src,
+		     delivery->dst, delivery->seq, 0, delivery->len);
 
-		if (ret != 0) {
-			buffer[pos][buffer_index[pos]] = *buf;
-			buffer_index[pos] += 1;
-			return TRUE;
+	delivery_free(worker, delivery);
+}
+
+static void deliver_inbox(struct worker *worker)
+{
+	struct delivery *delivery;
+	struct mpsc_node *node;
+	uint64_t count, now = now_us();
+
+	read(worker->wake_fd, &count, sizeof(count));
+
+	while ((node = mpsc_pop(&worker->inbox))) {
+		delivery = (struct delivery *)node;
+		medium_receive(delivery->dst, delivery->rx_start,
+			       delivery->timer.due, &delivery->lost);
+
+		if (delivery->timer.due > now) {
+			wheel_add(&worker->wheel, &delivery->timer);
+			continue;
 		}
+
+		deliver(worker, delivery);
 	}
+}
 
-	if (buffer_index[pos] == 0) {
-		/* We have no buffer do the regular process */
+/* write out the frames that are due and arm the timer for the next */
+static void run_timers(struct worker *worker)
+{
+	struct itimerspec its = { 0 };
+	struct wheel_timer *timer, *next;
+	uint64_t due;
 
-		if (packet_state[pos] == PACKET_START) {
-			/* packet not started */
-			if (*buf == 0xF0) {
-				setup_reachable_nodes(pos);
+	timer = wheel_expire(&worker->wheel, now_us());
 
-				/* Packet started */
-				broadcast_data(pos, buf);
-				packet_state[pos] = FRAME_SIZE;
+	for (; timer; timer = next) {
+		next = timer->next;
+		deliver(worker, delivery_of(timer));
+	}
 
-			} else {
-				/* Wrong byte of start */
-				printf("Wrong byte for pkt start %d\n", *buf);
-				sem_post(sem);
-				return TRUE;
-			}
-		} else if (packet_state[pos] == FRAME_SIZE) {
-			packet_len[pos] = (int)*buf;
-			broadcast_data(pos, buf);
-			packet_state[pos] = PACKET_PSDU;
-		} else if (packet_state[pos] == PACKET_PSDU) {
-			broadcast_data(pos, buf);
-			packet_index[pos] += 1;
-
-			if (packet_index[pos] == packet_len[pos]) {
-				packet_state[pos] = 0;
-				packet_index[pos] = 0;
-				packet_len[pos] = 0;
-				reset_reachable_nodes(pos);
-				printf("Unlock packet %d\n", pos);
-				sem_post(sem);
-			}
+	due = wheel_next(&worker->wheel);
+	if (due == worker->armed) {
+		return;
+	}
+
+	its.it_value.tv_sec = due / 1000000;
+	its.it_value.tv_nsec = due % 1000000 * 1000;
+	timerfd_settime(worker->timer_fd, TFD_TIMER_ABSTIME, &its, NULL);
+	worker->armed = due;
+}
+
+static void read_node(struct worker *worker, int pos)
+{
+	unsigned char buf[READ_SIZE];
+	unsigned long long garbage;
+	ssize_t result;
+
+	if (fd_out[pos] < 0) {
+		return;
+	}
+
+	result = read(fd_out[pos], buf, sizeof(buf));
+
+	if (result < 0 && (errno == EINTR || errno == EAGAIN)) {
+		return;
+	}
+
+	if (result <= 0) {
+		printf("Pipe %s closed\n", pipe_out[pos]);
+		epoll_ctl(worker->epoll_fd, EPOLL_CTL_DEL, fd_out[pos], NULL);
+		close(fd_out[pos]);
+		fd_out[pos] = -1;
+		return;
+	}
+
+	/* frames are sent as soon as they are complete, the start of the
+	 * next one waits in the parser for the next read
+	 */
+	garbage = parser[pos].stats.garbage;
+
+	frame_parser_feed(&parser[pos], buf, result, queue_frame,
+			  GINT_TO_POINTER(pos));
+
+	if (parser[pos].stats.garbage != garbage) {
+		printf("Skipped %llu wrong bytes for pkt start\n",
+		       parser[pos].stats.garbage - garbage);
+	}
+}
+
+static void *worker_run(void *data)
+{
+	struct worker *worker = data;
+	struct epoll_event events[MAX_EVENTS];
+	int n;
+
+	while (!atomic_load(&stop)) {
+		/* what was decided is on disk before waiting, should the hub
+		 * be killed or crash meanwhile
+		 */
+		eventlog_flush(&worker->log);
+
+		atomic_store(&worker->idle, true);
+		n = epoll_wait(worker->epoll_fd, events, MAX_EVENTS, -1);
+		atomic_store(&worker->idle, false);
+
+		if (n < 0 && errno != EINTR) {
+			printf("Worker %d failed to wait (%s)\n", worker->id,
+			       strerror(errno));
+			kill(getpid(), SIGTERM);
+			break;
 		}
-	} else {
-		/* We do have buffer. Go for bulk send */
-		buffer[pos][buffer_index[pos]] = *buf;
-		buffer_index[pos] += 1;
-
-		for (int i = 0; i < buffer_index[pos]; ++i) {
-			*buf = buffer[pos][i];
-			buffer[pos][i] = 0xFF;
-
-			if (packet_state[pos] == PACKET_START) {
-				/* packet not started */
-				if (*buf == 0xF0) {
-					setup_reachable_nodes(pos);
-
-					/* Packet started */
-					broadcast_data(pos, buf);
-					packet_state[pos] = FRAME_SIZE;
-
-				} else {
-					/* Wrong byte of start */
-					printf("Wrong byte for pkt start %d\n",
-						*buf);
-				}
-			} else if (packet_state[pos] == FRAME_SIZE) {
-				packet_len[pos] = (int)*buf;
-				broadcast_data(pos, buf);
-				packet_state[pos] = PACKET_PSDU;
-			} else if (packet_state[pos] == PACKET_PSDU) {
-				broadcast_data(pos, buf);
-				packet_index[pos] += 1;
-
-				if (packet_index[pos] == packet_len[pos]) {
-					packet_state[pos] = 0;
-					packet_index[pos] = 0;
-					packet_len[pos] = 0;
-					reset_reachable_nodes(pos);
-				}
+
+		for (int i = 0; i < n; i++) {
+			uint64_t count;
+
+			if (events[i].data.u32 == WAKE_EVENT) {
+				deliver_inbox(worker);
+			} else if (events[i].data.u32 == TIMER_EVENT) {
+				read(worker->timer_fd, &count, sizeof(count));
+				worker->armed = 0;
+			} else {
+				read_node(worker, events[i].data.u32);
 			}
 		}
 
-		buffer_index[pos] = 0;
-		if (packet_state[pos] == PACKET_START) {
-			printf("Unlock buffer %d\n", pos);
-			sem_post(sem);
+		schedule(worker);
+		run_timers(worker);
+		atomic_fetch_add(&worker->passes, 1);
+	}
+
+	atomic_store(&worker->idle, true);
+
+	return NULL;
+}
+
+/* Grace period of the topology swaps: a worker that was waiting for
+ * events, or that went once round its loop, no longer holds a topology
+ * loaded before. Only waits on the workers that are busy: one that has
+ * not started or has stopped is idle, so this ends at shutdown too.
+ */
+void synchronize_workers(void)
+{
+	for (int i = 0; i < num_workers; i++) {
+		struct worker *worker = &workers[i];
+		unsigned long passes = atomic_load(&worker->passes);
+
+		while (!atomic_load(&worker->idle) &&
+		       atomic_load(&worker->passes) == passes) {
+			usleep(100);
 		}
 	}
+}
+
+static int setup_worker(struct worker *worker, int id)
+{
+	struct epoll_event ev = { .events = EPOLLIN,
+				  .data.u32 = WAKE_EVENT };
+	struct epoll_event timer_ev = { .events = EPOLLIN,
+					.data.u32 = TIMER_EVENT };
+
+	worker->id = id;
+	worker->wake = calloc(num_workers, sizeof(bool));
+	atomic_init(&worker->idle, true);
+	mpsc_init(&worker->inbox);
+	mpsc_init(&worker->returns);
+	wheel_init(&worker->wheel, now_us());
+
+	worker->epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+	worker->wake_fd = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+	worker->timer_fd = timerfd_create(CLOCK_MONOTONIC,
+					  TFD_CLOEXEC | TFD_NONBLOCK);
+	if (worker->epoll_fd < 0 || worker->wake_fd < 0 ||
+	    worker->timer_fd < 0) {
+		return -errno;
+	}
+
+	if (epoll_ctl(worker->epoll_fd, EPOLL_CTL_ADD, worker->wake_fd,
+		      &ev) < 0 ||
+	    epoll_ctl(worker->epoll_fd, EPOLL_CTL_ADD, worker->timer_fd,
+		      &timer_ev) < 0) {
+		return -errno;
+	}
 
-finish:
-	return TRUE;
+	return 0;
 }
 
 static int setup_fifofd(char *pipe, int pos)
 {
-	GIOChannel *channel;
-	guint source;
+	struct epoll_event ev = { .events = EPOLLIN, .data.u32 = pos };
 	int fd;
 	char *pipe_new = pipe;
 
@@ -264,78 +591,276 @@ static int setup_fifofd(char *pipe, int pos)
 		return fd;
 	}
 
-	channel = g_io_channel_unix_new(fd);
-	g_io_channel_set_close_on_unref(channel, TRUE);
+	if (epoll_ctl(worker_of(pos)->epoll_fd, EPOLL_CTL_ADD, fd,
+		      &ev) < 0) {
+		close(fd);
+		return -1;
+	}
 
-	source = g_io_add_watch(channel,
-			G_IO_IN | G_IO_HUP | G_IO_ERR | G_IO_NVAL,
-			fifo_handler, GINT_TO_POINTER(pos));
+	return fd;
+}
 
-	g_io_channel_unref(channel);
-	return source;
+static void usage(const char *name)
+{
+	printf("Usage: %s [-j workers] [-l us] [-J us] [-B bit/s] "
+	       "[-G p,r[,loss]] [-c socket]\n"
+	       "       [-s seed] [-w log] [-r log] <graph.csv>\n"
+	       "       %s -p log\n", name, name);
+	printf("   graph.csv is a matrix of delivery probabilities, or a "
+	       "list of links\n"
+	       "   src,dst,prob[,delay] after a header line\n");
+	printf("   -j Share the nodes between this many threads "
+	       "(default 1)\n");
+	printf("   -l Propagation delay of every link\n");
+	printf("   -J Random jitter added to the latency, up to this "
+	       "much\n");
+	printf("   -B Bit rate on the air, for the air time of the "
+	       "frames and collisions\n"
+	       "      (default 250000, 0 to deliver at once)\n");
+	printf("   -G Gilbert-Elliott burst loss: chance per frame of a "
+	       "link going bad\n"
+	       "      and of recovering, and the loss while bad "
+	       "(default 1)\n");
+	printf("   -c Take link updates and scripts on this UNIX "
+	       "socket\n");
+	printf("   -s Seed of the random streams of the links (default "
+	       "the time)\n");
+	printf("   -w Write what became of every frame to this event "
+	       "log\n");
+	printf("   -r Replay an event log: frames are lost, delayed and "
+	       "collide as in it\n");
+	printf("   -p Print an event log\n");
 }
 
-int main(int argc, char *argv[])
+/* numbers in base 10, all of them, as the control socket takes them */
+static int parse_number(int opt, const char *str, unsigned long long max,
+			unsigned long long *value)
 {
-	int ret;
-	char str_num[4];
-	int currentIndex;
+	unsigned long long v;
+	char *end;
 
-	srand((unsigned int) time(NULL));
+	errno = 0;
+	v = strtoull(str, &end, 10);
 
-	/* verify if the hub is using graph's */
-	if (argc == 2) {
-		m = read_csv(argv[1]);
+	if (*end || end == str || errno || str[0] == '-' || v > max) {
+		printf("Bad -%c %s\n", opt, str);
+		return -1;
+	}
+
+	*value = v;
+
+	return 0;
+}
+
+static int parse_u32(int opt, const char *str, uint32_t *value)
+{
+	unsigned long long v;
+
+	if (parse_number(opt, str, UINT32_MAX, &v) < 0) {
+		return -1;
+	}
+
+	*value = v;
+
+	return 0;
+}
+
+/* p,r[,loss], chances in [0, 1]. A link that never recovers would be
+ * bad for good, so r is above 0.
+ */
+static int parse_ge(const char *str)
+{
+	float value[3] = { 0, 0, channel.ge_bad_loss };
+	const char *p = str;
+	char *end = NULL;
+	int count;
+
+	for (count = 0; count < 3; count++) {
+		value[count] = strtof(p, &end);
+
+		if (end == p || !(value[count] >= 0 && value[count] <= 1)) {
+			goto fail;
+		}
+
+		p = end + 1;
+
+		if (*end != ',') {
+			count++;
+			break;
+		}
+	}
+
+	if (*end || count < 2 || value[1] == 0) {
+		goto fail;
+	}
+
+	channel.ge_p = value[0];
+	channel.ge_r = value[1];
+	channel.ge_bad_loss = value[2];
+
+	return 0;
+
+fail:
+	printf("Bad -G %s, expected p,r[,loss] in [0, 1] with r above 0\n",
+	       str);
+
+	return -1;
+}
+
+static void print_medium_stats(void)
+{
+	for (int i = 0; i < number_nodes; i++) {
+		const struct medium_stats *stats = medium_stats(i);
 
-		if (m == NULL) {
-			printf("Error reading csv file.\n");
+		printf("Node %d: %llu received, %llu collided, %llu lost "
+		       "while sending, %llu sent on a busy channel\n", i + 1,
+		       stats->rx, stats->collisions, stats->deaf,
+		       stats->busy_tx);
+	}
+}
+
+int main(int argc, char *argv[])
+{
+	struct topology *initial;
+	char *control = NULL;
+	char *record = NULL;
+	char *replay = NULL;
+	bool seeded = false;
+	unsigned long long number;
+	sigset_t signals;
+	int ret;
+	int currentIndex = 0;
+	int started = 0;
+	int open_fifo = 0;
+	int c;
+
+	while ((c = getopt(argc, argv, "j:l:J:B:G:c:s:w:r:p:h")) != -1) {
+		switch (c) {
+		case 'j':
+			if (parse_number(c, optarg, INT_MAX, &number) < 0) {
+				return 1;
+			}
+			num_workers = number;
+			break;
+		case 'l':
+			if (parse_u32(c, optarg, &channel.latency_us) < 0) {
+				return 1;
+			}
+			break;
+		case 'J':
+			if (parse_u32(c, optarg, &channel.jitter_us) < 0) {
+				return 1;
+			}
+			break;
+		case 'B':
+			if (parse_u32(c, optarg, &channel.bandwidth) < 0) {
+				return 1;
+			}
+			break;
+		case 'G':
+			if (parse_ge(optarg) < 0) {
+				return 1;
+			}
+			break;
+		case 'c':
+			control = optarg;
+			break;
+		case 's':
+			if (parse_number(c, optarg, UINT64_MAX,
+					 &number) < 0) {
+				return 1;
+			}
+			channel.seed = number;
+			seeded = true;
+			break;
+		case 'w':
+			record = optarg;
+			break;
+		case 'r':
+			replay = optarg;
+			break;
+		case 'p':
+			return eventlog_print(optarg) < 0 ? 1 : 0;
+		default:
+			usage(argv[0]);
 			return 1;
 		}
+	}
 
-		number_nodes = read_lines(argv[1]);
-	} else {
-		printf("Wrong input. Expecting: ./hub <graph.csv>");
+	/* verify if the hub is using graph's */
+	if (optind != argc - 1 || num_workers < 1) {
+		usage(argv[0]);
+		return 1;
+	}
+
+	initial = topology_load(argv[optind]);
+
+	if (initial == NULL) {
+		printf("Error reading the topology.\n");
+		return 1;
+	}
+
+	number_nodes = initial->n;
+	atomic_init(&topology, initial);
+
+	/* a replay goes on from the log with the streams of its run */
+	if (replay && eventlog_seed(replay, &channel.seed) < 0) {
+		return 1;
+	} else if (!replay && !seeded) {
+		channel.seed = time(NULL);
+	}
+
+	printf("Seed %llu\n", (unsigned long long) channel.seed);
+
+	if (channel_init_links(initial) < 0 || medium_init(number_nodes) < 0) {
+		printf("Failed to set up the medium\n");
+		return 1;
+	}
+
+	if (replay && eventlog_replay(replay, initial) < 0) {
+		return 1;
+	}
+
+	if (record && eventlog_open(record, number_nodes) < 0) {
+		return 1;
+	}
+
+	if (num_workers > number_nodes) {
+		num_workers = number_nodes;
 	}
 
 	/* alocate the size */
 	alloc_size();
 
-	int fifoTrain[number_nodes];
-	int open_fifo;
-
 	/* initializing variables */
 	for (int i = 0; i < number_nodes; i++) {
-		buffer_index[i] = 0;
-		packet_state[i] = 0;
-		packet_index[i] = 0;
-		packet_len[i] = 0;
+		frame_parser_init(&parser[i]);
+		fd_in[i] = -1;
+		fd_out[i] = -1;
 	}
 
-	/* Initialize reachable nodes*/
-	for (int i = 0; i < number_nodes; i++) {
-		for (int j = 0; j < number_nodes; j++) {
-			send[i][j] = FALSE;
+	workers = calloc(num_workers, sizeof(struct worker));
+
+	for (int i = 0; i < num_workers; i++) {
+		if (setup_worker(&workers[i], i) < 0) {
+			printf("Failed to set up worker %d\n", i);
+			ret = -EINVAL;
+			goto exit;
 		}
 	}
 
-	sem = (sem_t *) malloc(sizeof(sem_t));
-	sem_init(sem, 0, 1);
-
 	fdSize = number_nodes;
 
-	main_loop = g_main_loop_new(NULL, FALSE);
-
 	for (int i = 0; i < fdSize; i++) {
-		snprintf(str_num, sizeof(str_num), "%d", (i + 1));
-
-		pipe_in[i] = g_strconcat("/tmp/hub/ip-stack-node",
-			g_strconcat(str_num, PIPE_IN, NULL), NULL);
-		pipe_out[i] = g_strconcat("/tmp/hub/ip-stack-node",
-			g_strconcat(str_num, PIPE_OUT, NULL), NULL);
+		pipe_in[i] = g_strdup_printf("/tmp/hub/ip-stack-node%d%s",
+					     i + 1, PIPE_IN);
+		pipe_out[i] = g_strdup_printf("/tmp/hub/ip-stack-node%d%s",
+					      i + 1, PIPE_OUT);
+		currentIndex = i + 1;
 
-		fifoTrain[i] = setup_fifofd(pipe_out[i], i);
+		fd_out[i] = setup_fifofd(pipe_out[i], i);
 
-		if (fifoTrain[i] > 0) {
+		if (fd_out[i] >= 0) {
 			open_fifo++;
 		} else {
 			printf("Failed to open the fifo node %d\n", (i + 1));
@@ -354,35 +879,83 @@ int main(int argc, char *argv[])
 	}
 
 	for (int i = 0; i < fdSize; i++) {
-		currentIndex = i;
 		fd_in[i] = open(pipe_in[i], O_WRONLY);
 
 		if (fd_in[i] < 0) {
 			ret = -EINVAL;
 			goto exit;
 		}
+
+		fcntl(fd_in[i], F_SETFL, O_NONBLOCK);
 	}
 
-	g_main_loop_run(main_loop);
+	/* a node that stopped reading must not take the hub down */
+	signal(SIGPIPE, SIG_IGN);
+
+	/* only the main thread takes the signals to stop */
+	sigemptyset(&signals);
+	sigaddset(&signals, SIGINT);
+	sigaddset(&signals, SIGTERM);
+	pthread_sigmask(SIG_BLOCK, &signals, NULL);
+
+	start_us = now_us();
+
+	for (started = 0; started < num_workers; started++) {
+		if (pthread_create(&workers[started].thread, NULL, worker_run,
+				   &workers[started]) != 0) {
+			printf("Failed to start worker %d\n", started);
+			ret = -EINVAL;
+			goto stop;
+		}
+	}
+
+	/* updates wait on the workers, which have to be running */
+	if (control && control_start(control) < 0) {
+		printf("Failed to listen on %s (%s)\n", control,
+		       strerror(errno));
+		ret = -EINVAL;
+		goto stop;
+	}
+
+	printf("%d nodes, %d links, on %d worker(s)\n", number_nodes,
+	       initial->row_ptr[number_nodes], num_workers);
+
+	sigwait(&signals, &c);
 	ret = 0;
 
+stop:
+	atomic_store(&stop, true);
+	for (int i = 0; i < started; i++) {
+		uint64_t one = 1;
+
+		write(workers[i].wake_fd, &one, sizeof(one));
+	}
+
+	for (int i = 0; i < started; i++) {
+		pthread_join(workers[i].thread, NULL);
+		eventlog_flush(&workers[i].log);
+	}
+
+	if (!ret && channel.bandwidth) {
+		print_medium_stats();
+	}
+
 exit:
 	for (int i = 0; i < currentIndex; i++) {
-		if (fifoTrain[i] >= 0) {
-			g_source_remove(fifoTrain[i]);
+		if (fd_out[i] >= 0) {
+			close(fd_out[i]);
 		}
 
 		if (fd_in[i] >= 0) {
 			close(fd_in[i]);
 		}
-
-		g_free(pipe_in[i]);
-		g_free(pipe_out[i]);
 	}
 
-	sem_destroy(sem);
-	free_memory(m, number_nodes);
-	g_main_loop_unref(main_loop);
+	control_stop();
+	eventlog_close();
+	channel_free_links(atomic_load(&topology));
+	topology_free(atomic_load(&topology));
+	medium_free();
 	dealloc_size();
 
 	exit(ret);
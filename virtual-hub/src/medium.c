@@ -0,0 +1,242 @@
+/*
+ * Copyright (c) 2018 CPqD Foundation
+ *
+ * SPDX-License-Identifier: Apache-2.0
+ */
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "channel.h"
+#include "frame_parser.h"
+#include "medium.h"
+
+#define MEDIUM_SPANS 16
+
+/* spans kept after they end, for frames from other workers that are
+ * registered late
+ */
+#define MEDIUM_HISTORY_US 100000
+
+static struct medium_node *nodes;
+static int num_nodes;
+static uint64_t max_air;
+
+int medium_init(int n)
+{
+	nodes = calloc(n, sizeof(struct medium_node));
+	if (!nodes) {
+		return -1;
+	}
+
+	num_nodes = n;
+	max_air = channel_air_time(FRAME_MAX);
+
+	return 0;
+}
+
+void medium_free(void)
+{
+	for (int i = 0; i < num_nodes; i++) {
+		free(nodes[i].span);
+	}
+
+	free(nodes);
+}
+
+/* first span starting at or after start */
+static unsigned int span_find(const struct medium_node *node, uint64_t start)
+{
+	unsigned int lo = 0, hi = node->count;
+
+	while (lo < hi) {
+		unsigned int mid = (lo + hi) / 2;
+
+		if (node->span[mid].start < start) {
+			lo = mid + 1;
+		} else {
+			hi = mid;
+		}
+	}
+
+	return lo;
+}
+
+/* first span that may overlap a span starting at start */
+static unsigned int span_first(const struct medium_node *node, uint64_t start)
+{
+	return span_find(node, start > max_air ? start - max_air : 0);
+}
+
+/* drop the spans that are over and no longer referenced by a frame,
+ * and make room for one more
+ */
+static int span_reserve(struct medium_node *node, uint64_t start)
+{
+	struct medium_span *span;
+	unsigned int count = 0;
+
+	if (node->count < node->size) {
+		return 0;
+	}
+
+	for (unsigned int i = 0; i < node->count; i++) {
+		if (node->span[i].lost ||
+		    node->span[i].end + MEDIUM_HISTORY_US >= start) {
+			node->span[count++] = node->span[i];
+		}
+	}
+
+	node->count = count;
+	if (count < node->size) {
+		return 0;
+	}
+
+	span = realloc(node->span, (node->size ? node->size * 2 :
+				    MEDIUM_SPANS) * sizeof(*span));
+	if (!span) {
+		return -1;
+	}
+
+	node->span = span;
+	node->size = node->size ? node->size * 2 : MEDIUM_SPANS;
+
+	return 0;
+}
+
+/* spans mostly come in order, so this rarely moves any */
+static void span_insert(struct medium_node *node,
+			const struct medium_span *span)
+{
+	unsigned int i;
+
+	if (span_reserve(node, span->start) < 0) {
+		return;
+	}
+
+	i = node->count;
+	while (i > 0 && node->span[i - 1].start > span->start) {
+		i--;
+	}
+
+	memmove(&node->span[i + 1], &node->span[i],
+		(node->count - i) * sizeof(*span));
+	node->span[i] = *span;
+	node->count++;
+}
+
+static void mark_lost(bool *lost, unsigned long long *counter)
+{
+	if (lost && !*lost) {
+		*lost = true;
+		(*counter)++;
+	}
+}
+
+/* Put a frame of the node on the air, after the one it is sending if
+ * any. Returns when it is off the air. Frames the node was receiving
+ * meanwhile are lost, the radio is half duplex.
+ */
+uint64_t medium_transmit(int pos, uint64_t now_us, uint8_t len)
+{
+	struct medium_node *node = &nodes[pos];
+	struct medium_span span = {
+		.start = now_us > node->tx_until ? now_us : node->tx_until,
+		.tx = true,
+	};
+
+	if (!channel.bandwidth) {
+		return now_us;
+	}
+
+	span.end = span.start + channel_air_time(len);
+
+	if (medium_channel_busy(pos, span.start)) {
+		node->stats.busy_tx++;
+	}
+
+	for (unsigned int i = span_first(node, span.start);
+	     i < node->count && node->span[i].start < span.end; i++) {
+		if (node->span[i].end > span.start) {
+			mark_lost(node->span[i].lost, &node->stats.deaf);
+		}
+	}
+
+	span_insert(node, &span);
+	node->tx_until = span.end;
+
+	return span.end;
+}
+
+/* A frame reaches the node's antenna. It and any frame it overlaps are
+ * lost, as is the frame if the node is sending at the time.
+ */
+void medium_receive(int pos, uint64_t start_us, uint64_t end_us, bool *lost)
+{
+	struct medium_node *node = &nodes[pos];
+	struct medium_span span = {
+		.start = start_us,
+		.end = end_us,
+		.lost = lost,
+	};
+
+	if (!channel.bandwidth) {
+		return;
+	}
+
+	for (unsigned int i = span_first(node, start_us);
+	     i < node->count && node->span[i].start < end_us; i++) {
+		struct medium_span *other = &node->span[i];
+
+		if (other->end <= start_us) {
+			continue;
+		}
+
+		if (other->tx) {
+			mark_lost(lost, &node->stats.deaf);
+		} else {
+			mark_lost(lost, &node->stats.collisions);
+			mark_lost(other->lost, &node->stats.collisions);
+		}
+	}
+
+	span_insert(node, &span);
+}
+
+/* the frame registered by medium_receive() has been handled */
+void medium_release(int pos, uint64_t start_us, bool *lost)
+{
+	struct medium_node *node = &nodes[pos];
+
+	if (!*lost) {
+		node->stats.rx++;
+	}
+
+	for (unsigned int i = span_find(node, start_us);
+	     i < node->count && node->span[i].start == start_us; i++) {
+		if (node->span[i].lost == lost) {
+			node->span[i].lost = NULL;
+			break;
+		}
+	}
+}
+
+/* clear channel assessment: energy from another node on the air */
+bool medium_channel_busy(int pos, uint64_t now_us)
+{
+	struct medium_node *node = &nodes[pos];
+
+	for (unsigned int i = span_first(node, now_us);
+	     i < node->count && node->span[i].start <= now_us; i++) {
+		if (!node->span[i].tx && node->span[i].end > now_us) {
+			return true;
+		}
+	}
+
+	return false;
+}
+
+const struct medium_stats *medium_stats(int pos)
+{
+	return &nodes[pos].stats;
+}
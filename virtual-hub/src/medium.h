@@ -0,0 +1,52 @@
+/*
+ * Copyright (c) 2018 CPqD Foundation
+ *
+ * SPDX-License-Identifier: Apache-2.0
+ */
+
+#ifndef MEDIUM_H_
+#define MEDIUM_H_
+
+#include <stdbool.h>
+#include <stdint.h>
+
+struct medium_stats {
+	unsigned long long rx;		/* frames received whole */
+	unsigned long long collisions;	/* lost to another frame */
+	unsigned long long deaf;	/* lost while transmitting */
+	unsigned long long busy_tx;	/* sent while the channel was busy */
+};
+
+/* time a node's radio spends on a frame, sending or receiving it */
+struct medium_span {
+	uint64_t start;		/* us */
+	uint64_t end;
+	bool *lost;		/* set on a collision, NULL once received */
+	bool tx;
+};
+
+/* spans at a node sorted by start, all of them at most the air time of
+ * the longest frame long, so the spans overlapping a time are found by
+ * a binary search and a short scan
+ */
+struct medium_node {
+	uint64_t tx_until;	/* end of the node's last frame on the air */
+	struct medium_span *span;
+	unsigned int count;
+	unsigned int size;
+	struct medium_stats stats;
+};
+
+/* Each node is only touched by the worker that owns it: its frames are
+ * sent and received there.
+ */
+int medium_init(int n);
+void medium_free(void);
+uint64_t medium_transmit(int node, uint64_t now_us, uint8_t len);
+void medium_receive(int node, uint64_t start_us, uint64_t end_us,
+		    bool *lost);
+void medium_release(int node, uint64_t start_us, bool *lost);
+bool medium_channel_busy(int node, uint64_t now_us);
+const struct medium_stats *medium_stats(int node);
+
+#endif
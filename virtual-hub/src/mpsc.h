@@ -0,0 +1,83 @@
+/*
+ * Copyright (c) 2018 CPqD Foundation
+ *
+ * SPDX-License-Identifier: Apache-2.0
+ */
+
+#ifndef MPSC_H
+#define MPSC_H
+
+#include <stdatomic.h>
+#include <stddef.h>
+
+/* intrusive multiple producer single consumer queue (D. Vyukov): a push
+ * is one exchange and one store, a pop takes no atomic read-modify-write
+ * at all
+ */
+struct mpsc_node {
+	_Atomic(struct mpsc_node *) next;
+};
+
+struct mpsc {
+	_Alignas(64) _Atomic(struct mpsc_node *) head;	/* producers */
+	_Alignas(64) struct mpsc_node *tail;		/* consumer */
+	struct mpsc_node stub;
+};
+
+static inline void mpsc_init(struct mpsc *q)
+{
+	atomic_init(&q->stub.next, NULL);
+	atomic_init(&q->head, &q->stub);
+	q->tail = &q->stub;
+}
+
+static inline void mpsc_push(struct mpsc *q, struct mpsc_node *node)
+{
+	struct mpsc_node *prev;
+
+	atomic_store_explicit(&node->next, NULL, memory_order_relaxed);
+	prev = atomic_exchange_explicit(&q->head, node, memory_order_acq_rel);
+	atomic_store_explicit(&prev->next, node, memory_order_release);
+}
+
+/* oldest node, NULL if the queue is empty or if a producer is half way
+ * through a push, which the producer has to follow with a wakeup
+ */
+static inline struct mpsc_node *mpsc_pop(struct mpsc *q)
+{
+	struct mpsc_node *tail = q->tail;
+	struct mpsc_node *next = atomic_load_explicit(&tail->next,
+						      memory_order_acquire);
+
+	if (tail == &q->stub) {
+		if (!next) {
+			return NULL;
+		}
+
+		q->tail = next;
+		tail = next;
+		next = atomic_load_explicit(&tail->next, memory_order_acquire);
+	}
+
+	if (next) {
+		q->tail = next;
+		return tail;
+	}
+
+	if (tail != atomic_load_explicit(&q->head, memory_order_acquire)) {
+		return NULL;
+	}
+
+	/* tail is the last node, put the stub behind it to take it out */
+	mpsc_push(q, &q->stub);
+
+	next = atomic_load_explicit(&tail->next, memory_order_acquire);
+	if (next) {
+		q->tail = next;
+		return tail;
+	}
+
+	return NULL;
+}
+
+#endif /* MPSC_H */
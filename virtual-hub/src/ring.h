@@ -0,0 +1,88 @@
+/*
+ * Copyright (c) 2018 CPqD Foundation
+ *
+ * SPDX-License-Identifier: Apache-2.0
+ */
+
+#ifndef RING_H
+#define RING_H
+
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stdint.h>
+
+#include "frame_parser.h"
+
+/* frames queued per node, must be a power of two */
+#define RING_SIZE 256
+
+struct ring_frame {
+	uint8_t len;
+	uint8_t psdu[FRAME_MAX];
+};
+
+/* single producer single consumer queue of frames: only the producer
+ * moves head and only the consumer moves tail, each on its own cache
+ * line
+ */
+struct ring {
+	_Alignas(64) atomic_uint head;
+	_Alignas(64) atomic_uint tail;
+	struct ring_frame frame[RING_SIZE];
+};
+
+/* slot for the next frame, NULL if the ring is full */
+static inline struct ring_frame *ring_reserve(struct ring *ring)
+{
+	unsigned int head = atomic_load_explicit(&ring->head,
+						 memory_order_relaxed);
+	unsigned int tail = atomic_load_explicit(&ring->tail,
+						 memory_order_acquire);
+
+	if (head - tail == RING_SIZE) {
+		return NULL;
+	}
+
+	return &ring->frame[head & (RING_SIZE - 1)];
+}
+
+/* publish the slot returned by ring_reserve() */
+static inline void ring_push(struct ring *ring)
+{
+	unsigned int head = atomic_load_explicit(&ring->head,
+						 memory_order_relaxed);
+
+	atomic_store_explicit(&ring->head, head + 1, memory_order_release);
+}
+
+/* oldest frame, NULL if the ring is empty */
+static inline struct ring_frame *ring_peek(struct ring *ring)
+{
+	unsigned int tail = atomic_load_explicit(&ring->tail,
+						 memory_order_relaxed);
+	unsigned int head = atomic_load_explicit(&ring->head,
+						 memory_order_acquire);
+
+	if (head == tail) {
+		return NULL;
+	}
+
+	return &ring->frame[tail & (RING_SIZE - 1)];
+}
+
+/* release the frame returned by ring_peek() */
+static inline void ring_pop(struct ring *ring)
+{
+	unsigned int tail = atomic_load_explicit(&ring->tail,
+						 memory_order_relaxed);
+
+	atomic_store_explicit(&ring->tail, tail + 1, memory_order_release);
+}
+
+static inline bool ring_empty(struct ring *ring)
+{
+	return atomic_load_explicit(&ring->head, memory_order_acquire) ==
+		atomic_load_explicit(&ring->tail, memory_order_acquire);
+}
+
+#endif /* RING_H */
@@ -0,0 +1,202 @@
+/*
+ * Copyright (c) 2018 CPqD Foundation
+ *
+ * SPDX-License-Identifier: Apache-2.0
+ */
+
+#include <stddef.h>
+
+#include "wheel.h"
+
+#define WHEEL_TOP_SHIFT (WHEEL_BITS * WHEEL_LEVELS)
+
+/* first tick starting at or after due, so that no timer fires early */
+static uint64_t tick_of(uint64_t due_us)
+{
+	return (due_us + WHEEL_TICK_US - 1) / WHEEL_TICK_US;
+}
+
+static void slot_init(struct wheel_slot *slot)
+{
+	slot->head = NULL;
+	slot->tail = &slot->head;
+}
+
+static void slot_append(struct wheel_slot *slot, struct wheel_timer *timer)
+{
+	timer->next = NULL;
+	*slot->tail = timer;
+	slot->tail = &timer->next;
+}
+
+static struct wheel_timer *slot_take(struct wheel_slot *slot)
+{
+	struct wheel_timer *head = slot->head;
+
+	slot_init(slot);
+
+	return head;
+}
+
+static void wheel_place(struct wheel *wheel, struct wheel_timer *timer)
+{
+	uint64_t tick = tick_of(timer->due);
+	int level, shift, i;
+
+	if (tick < wheel->tick) {
+		tick = wheel->tick;
+	}
+
+	for (level = 0; level < WHEEL_LEVELS; level++) {
+		shift = WHEEL_BITS * (level + 1);
+
+		if (tick >> shift == wheel->tick >> shift) {
+			break;
+		}
+	}
+
+	if (level == WHEEL_LEVELS) {
+		slot_append(&wheel->far, timer);
+		return;
+	}
+
+	i = (tick >> (WHEEL_BITS * level)) & (WHEEL_SIZE - 1);
+	slot_append(&wheel->slot[level][i], timer);
+	wheel->used[level] |= 1ULL << i;
+}
+
+static void wheel_replace(struct wheel *wheel, struct wheel_timer *timer)
+{
+	struct wheel_timer *next;
+
+	for (; timer; timer = next) {
+		next = timer->next;
+		wheel_place(wheel, timer);
+	}
+}
+
+/* Move the timers of the slots starting at the new tick one level down
+ * or more, the top first: timers of a higher level were added before
+ * those of a lower one due in the same tick, so they stay ahead.
+ */
+static void wheel_advance(struct wheel *wheel, uint64_t tick)
+{
+	if (tick == wheel->tick) {
+		return;
+	}
+
+	wheel->tick = tick;
+
+	if (!(tick & ((1ULL << WHEEL_TOP_SHIFT) - 1))) {
+		wheel_replace(wheel, slot_take(&wheel->far));
+	}
+
+	for (int level = WHEEL_LEVELS - 1; level > 0; level--) {
+		int shift = WHEEL_BITS * level;
+		int i = (tick >> shift) & (WHEEL_SIZE - 1);
+
+		if (tick & ((1ULL << shift) - 1) ||
+		    !(wheel->used[level] & 1ULL << i)) {
+			continue;
+		}
+
+		wheel->used[level] &= ~(1ULL << i);
+		wheel_replace(wheel, slot_take(&wheel->slot[level][i]));
+	}
+}
+
+/* Next tick with something to do, a timer to fire or a slot to move
+ * down. The lowest level in use holds the earliest timers, and its
+ * slots are all ahead of the current one.
+ */
+static uint64_t wheel_next_tick(const struct wheel *wheel)
+{
+	for (int level = 0; level < WHEEL_LEVELS; level++) {
+		int shift = WHEEL_BITS * level;
+		uint64_t base;
+
+		if (!wheel->used[level]) {
+			continue;
+		}
+
+		base = wheel->tick >> (shift + WHEEL_BITS) <<
+			(shift + WHEEL_BITS);
+
+		return base | (uint64_t)__builtin_ctzll(wheel->used[level]) <<
+			shift;
+	}
+
+	return ((wheel->tick >> WHEEL_TOP_SHIFT) + 1) << WHEEL_TOP_SHIFT;
+}
+
+void wheel_init(struct wheel *wheel, uint64_t now_us)
+{
+	wheel->tick = now_us / WHEEL_TICK_US;
+	wheel->count = 0;
+
+	for (int level = 0; level < WHEEL_LEVELS; level++) {
+		wheel->used[level] = 0;
+
+		for (int i = 0; i < WHEEL_SIZE; i++) {
+			slot_init(&wheel->slot[level][i]);
+		}
+	}
+
+	slot_init(&wheel->far);
+}
+
+/* timers due in the past fire with the next tick */
+void wheel_add(struct wheel *wheel, struct wheel_timer *timer)
+{
+	wheel_place(wheel, timer);
+	wheel->count++;
+}
+
+/* take out the timers due by now, as a list in tick order */
+struct wheel_timer *wheel_expire(struct wheel *wheel, uint64_t now_us)
+{
+	uint64_t end = now_us / WHEEL_TICK_US;
+	struct wheel_timer *expired = NULL, **last = &expired;
+
+	while (wheel->count) {
+		uint64_t tick = wheel_next_tick(wheel);
+		int i = tick & (WHEEL_SIZE - 1);
+		struct wheel_slot *slot = &wheel->slot[0][i];
+
+		if (tick > end) {
+			break;
+		}
+
+		wheel_advance(wheel, tick);
+
+		if (!(wheel->used[0] & 1ULL << i)) {
+			/* only moved timers down */
+			continue;
+		}
+
+		wheel->used[0] &= ~(1ULL << i);
+		*last = slot->head;
+
+		for (; *last; last = &(*last)->next) {
+			wheel->count--;
+		}
+
+		slot_init(slot);
+	}
+
+	if (end + 1 > wheel->tick) {
+		wheel_advance(wheel, end + 1);
+	}
+
+	return expired;
+}
+
+/* time of the next tick with something to do, 0 if there is no timer */
+uint64_t wheel_next(struct wheel *wheel)
+{
+	if (!wheel->count) {
+		return 0;
+	}
+
+	return wheel_next_tick(wheel) * WHEEL_TICK_US;
+}
@@ -0,0 +1,48 @@
+/*
+ * Copyright (c) 2018 CPqD Foundation
+ *
+ * SPDX-License-Identifier: Apache-2.0
+ */
+
+#ifndef WHEEL_H_
+#define WHEEL_H_
+
+#include <stdint.h>
+
+#define WHEEL_BITS 6
+#define WHEEL_SIZE (1 << WHEEL_BITS)	/* slots per level */
+#define WHEEL_LEVELS 4
+#define WHEEL_TICK_US 32		/* a byte on the air at 250 kbit/s */
+
+/* embedded in whatever is to happen at due */
+struct wheel_timer {
+	struct wheel_timer *next;
+	uint64_t due;		/* us */
+};
+
+struct wheel_slot {
+	struct wheel_timer *head;
+	struct wheel_timer **tail;
+};
+
+/* hierarchical timing wheel: level 0 has a slot per tick of the current
+ * WHEEL_SIZE ticks, each level above a slot per WHEEL_SIZE slots of the
+ * level below. A timer sits in the lowest level whose slot it shares with
+ * the current tick's upper bits and moves down when the wheel reaches
+ * its slot, so adding, expiring and finding the next timer are O(1).
+ * Timers due in the same tick fire in the order they were added.
+ */
+struct wheel {
+	uint64_t tick;		/* next tick to expire */
+	unsigned int count;
+	uint64_t used[WHEEL_LEVELS];	/* bitmap of the non-empty slots */
+	struct wheel_slot slot[WHEEL_LEVELS][WHEEL_SIZE];
+	struct wheel_slot far;	/* beyond the top level */
+};
+
+void wheel_init(struct wheel *wheel, uint64_t now_us);
+void wheel_add(struct wheel *wheel, struct wheel_timer *timer);
+struct wheel_timer *wheel_expire(struct wheel *wheel, uint64_t now_us);
+uint64_t wheel_next(struct wheel *wheel);
+
+#endif